@@ -1,3 +1,4 @@
+#define _GNU_SOURCE                                  /* fallocate */
 #include "stdio.h"
 #include "stdlib.h"
 #include <unistd.h>
@@ -6,10 +7,18 @@
 #include "string.h"
 #include <linux/fs.h>
 #include "ddriver_ctl.h"
+#include "ddriver_trace.h"
 #include "stdio.h"
 #include "errno.h"
-#include <pwd.h>
 #include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <stdint.h>
+#include <limits.h>
+#include "include/ddriver.h"
 
 extern int errno;
 
@@ -21,18 +30,20 @@ extern int errno;
 * SECTION: Macro definitions
 *******************************************************************************/   
 #define DEVICE_NAME   "ddriver"
-#define DEVICE_LOG    "ddriver_log"
+#define DEVICE_LOG    "_log"                      /* 日志文件：镜像路径加此后缀 */
 
 #define user_info(fmt, ...)\
 	do {\
 		printf(USER_INFO DEVICE_NAME " " fmt "\n", ##__VA_ARGS__);\
-        fprintf(debugf, USER_PANIC  " " fmt "\n", ##__VA_ARGS__);\
+        if (disk->debugf)\
+            fprintf(disk->debugf, USER_PANIC  " " fmt "\n", ##__VA_ARGS__);\
 	} while(0)\
 
 #define user_alert(fmt, ...)\
 	do {\
 		printf(USER_ALERT DEVICE_NAME " " fmt "\n", ##__VA_ARGS__);\
-        fprintf(debugf, USER_PANIC  " " fmt "\n", ##__VA_ARGS__);\
+        if (disk->debugf)\
+            fprintf(disk->debugf, USER_PANIC  " " fmt "\n", ##__VA_ARGS__);\
 	} while(0)\
 
 #define user_panic(fmt, ...)\
@@ -44,122 +55,1908 @@ extern int errno;
 #define DRIVER_DESC     "A Fake disk driver in user space"
 #define DRIVER_VERSION  "0.1.0"
 
-#define CONFIG_DISK_SZ  (4 * 1024 * 1024)
-#define CONFIG_BLOCK_SZ (512)
+#define CONFIG_DISK_SZ  (4 * 1024 * 1024)                /* 默认值，可由环境变量DDRIVER_DISK_SZ覆盖 */
+#define CONFIG_BLOCK_SZ (512)                            /* 默认值，可由环境变量DDRIVER_IO_SZ覆盖 */
+#define CONFIG_MAX_BLOCK_SZ (64 * 1024)
+#define ENV_DISK_SZ     "DDRIVER_DISK_SZ"
+#define ENV_IO_SZ       "DDRIVER_IO_SZ"
+#define ENV_MODEL       "DDRIVER_MODEL"
+#define ENV_SCHED       "DDRIVER_SCHED"
+#define ENV_PARALLEL    "DDRIVER_PARALLEL"
+#define ENV_FLUSH       "DDRIVER_FLUSH"
+#define ENV_CLOCK       "DDRIVER_CLOCK"
+#define ENV_CACHE       "DDRIVER_CACHE"                 /* 缓存大小，加",idle"为空闲时后台写回 */
+#define ENV_TRACE       "DDRIVER_TRACE"                 /* 非空且不为0时把请求记录到镜像路径加"_trace" */
+#define DEVICE_TRACE  "_trace"
+#define DEVICE_COW    "_cow"                      /* 克隆的重定向表：镜像路径加此后缀 */
+#define COW_MAGIC     0x57434444                  /* "DDCW" */
+#define CONFIG_MAX_DEVS (32)                         /* 一个进程最多同时打开的设备数 */
+#define CONFIG_QDEPTH   (8)                          /* 默认异步队列深度 */
+#define CONFIG_MAX_QDEPTH (64)
+#define CONFIG_PARALLEL (1)                          /* 默认设备并行度：单磁头，请求串行服务 */
+#define CONFIG_MAX_PARALLEL (64)
+#define CONFIG_MAX_MERGE_SZ (128 * 1024)                 /* 默认合并后的最大请求大小 */
+#define CONFIG_VBUSY (256)                           /* virtual模式记住的最近请求数 */
+#define CONFIG_CACHE_WRITE_LAT (10)                  /* 写入设备缓存的默认延迟(us) */
+#define CONFIG_CACHE_READ_LAT  (10)                  /* 读命中设备缓存的默认延迟(us) */
+#define CONFIG_CACHE_IDLE      (2000)                /* 空闲多久后开始后台写回的默认值(us) */
+#define SCHED_MAX_MERGE (32)                             /* 一次合并的最多请求数 */
 /******************************************************************************
 * SECTION: Macro Functions 
 *******************************************************************************/
 #define IGNORE_ARG(arg)         ((void)arg)
-#define IS_ADDR_ALIGN(addr)     (addr % CONFIG_BLOCK_SZ == 0)
-#define ADDR_ROUND_UP(addr)     ((addr / CONFIG_BLOCK_SZ) * CONFIG_BLOCK_SZ)
+#define IS_ADDR_ALIGN(addr)     (addr % disk->iounit_size == 0)
+#define ADDR_ROUND_UP(addr)     ((addr / disk->iounit_size) * disk->iounit_size)
 
-#define INC_READCNT(disk)       (disk.read_cnt++)
-#define INC_WRITECNT(disk)      (disk.write_cnt++)
-#define INC_SEEKCNT(disk)       (disk.seek_cnt++)
+#define INC_READCNT(disk)       (disk->stats.read_cnt++)
+#define INC_WRITECNT(disk)      (disk->stats.write_cnt++)
+#define INC_SEEKCNT(disk)       (disk->stats.seek_cnt++)
+#define CAP_INT(val)            ((val) > INT_MAX ? INT_MAX : (int)(val))
 
-#define RW_DELAY(disk, rw_ops)  (usleep(disk.rw_ops##_lat * 1000))
+#define DIV_ROUND_UP(a, b)      (((a) + (b) - 1) / (b))
+
+#define OP_SEEK                 (-1)                 /* 仅移动磁盘头，内部使用 */
+#define OP_DISCARD              (-2)                 /* 丢弃区间，内部使用 */
+#define OP_FLUSH                (-3)                 /* 刷写屏障，内部使用 */
+#define TRACE_OP(op)            ((op) == DDRIVER_OP_READ ? DDRIVER_TRACE_READ : DDRIVER_TRACE_WRITE)
 /******************************************************************************
 * SECTION: Type definitions
 *******************************************************************************/
+/* 一个正在服务的请求占用的设备区间 */
+struct ddriver_svc
+{
+    int   used;
+    int   op;
+    long  vstart;                                    /* virtual模式下开始服务的模拟时刻 */
+    off_t start;
+    off_t end;
+};
+
+/* virtual模式下一个已完成请求占用设备的模拟时间段 */
+struct ddriver_vbusy
+{
+    long start;
+    long end;
+    int  width;                                      /* 占用的并行度，刷写屏障占满 */
+};
+
+/* 克隆的重定向表文件头，之后紧跟每个IO单位一位的位图 */
+struct ddriver_cow_hdr
+{
+    uint32_t magic;
+    uint32_t iounit_size;
+    uint64_t layout_size;
+    char     base[DDRIVER_PATH_MAX];                 /* 快照镜像的绝对路径 */
+};
+
 struct ddriver
 {
-    int  ddriver_fd;                                 /* Disk ddriver_fd */
-    int  read_cnt;
-    int  write_cnt;
-    int  seek_cnt;
+    int  ddriver_fd;                                 /* Disk ddriver_fd，也是设备句柄 */
+    dev_t st_dev;                                    /* 镜像文件标识，防止同一镜像被打开两次 */
+    ino_t st_ino;
+    FILE *debugf;                                    /* 每个设备独立的日志 */
+    FILE *trace;                                     /* 请求记录，未开启时为NULL */
+    long  trace_start;
+    pthread_mutex_t trace_lock;
+    off_t head;                                      /* Disk Head, 不再依赖文件偏移 */
+    off_t pos;                                       /* 顺序读写接口的当前位置 */
+    struct ddriver_stats stats;                      /* 64位统计，受disk->lock保护 */
     int  read_lat;
     int  write_lat;
     int  seek_lat;
     int  track_num;
     int  major_num;
-    int  layout_size;
+    off_t layout_size;                               /* 设备大小，64位 */
     int  iounit_size;
+    /* 延迟模型 */
+    struct ddriver_model model;
+    int  in_service;                                 /* 正在服务的请求数，即svc中占用的槽数 */
+    int  parallel;                                   /* 设备并行度：同时服务的请求数上限 */
+    int  flush_mode;                                 /* enum ddriver_flush_mode */
+    struct ddriver_svc svc[CONFIG_MAX_PARALLEL];
+    pthread_cond_t  svc_cond;                        /* 有请求服务完成 */
+    long bw_busy_until;                              /* 带宽上限：传输通道空闲的时刻(us) */
+    /* 设备时钟 */
+    int  clock_mode;                                 /* enum ddriver_clock_mode */
+    int  idx;                                        /* 在devs中的下标，索引线程本地时钟 */
+    unsigned long clock_gen;                         /* 时钟纪元，重新计时后线程本地时钟作废 */
+    long clock_epoch;                                /* real模式：设备时间的起点(us) */
+    long vclock;                                     /* virtual模式：最晚完成的请求的模拟时刻(us) */
+    long vfloor;                                     /* virtual模式：更早的时间段已被淘汰，不能再插入 */
+    int  vbusy_next;
+    struct ddriver_vbusy vbusy[CONFIG_VBUSY];        /* virtual模式：最近完成的请求，环形覆盖 */
+    /* 异步请求队列 */
+    int  qdepth;                                     /* 同时在飞的请求数上限 = worker数 */
+    int  nworkers;
+    int  stopping;
+    int  inflight;                                   /* 已提交但尚未被收割的请求数 */
+    int  dispatched;                                 /* 已由调度器取出、尚未服务完的批次数 */
+    int  done_cnt;
+    struct ddriver_req *pending_head;
+    struct ddriver_req *pending_tail;
+    struct ddriver_req *done_head;
+    struct ddriver_req *done_tail;
+    pthread_mutex_t lock;                            /* 保护磁盘头、计数和请求队列 */
+    pthread_cond_t  submit_cond;
+    pthread_cond_t  complete_cond;
+    pthread_t       workers[CONFIG_MAX_QDEPTH];
+    /* 设备写缓存：数据总是立即写入镜像，这里只模拟时间 */
+    struct ddriver_cache cache;
+    unsigned char  *cache_dirty;                     /* 每个IO单位一位：在缓存中尚未写回介质 */
+    long           *cache_fifo;                      /* 按写入先后排列的IO单位，环形，可含已写回的条目 */
+    long  cache_cap;                                 /* 缓存的IO单位数，0为关闭 */
+    long  cache_head;
+    long  cache_used;
+    long  cache_dirty_cnt;
+    long  cache_idle_since;                          /* 设备最近一次变空闲的时刻 */
+    /* 调度器 */
+    struct ddriver_sched sched;
+    int  sched_dir;                                  /* 电梯方向：1向高地址，-1向低地址 */
+    int  sched_starved;                              /* deadline：写请求被读请求跳过的次数 */
+    /* mmap后端 */
+    char           *map;                             /* 整个镜像的共享映射，首次map_block时建立 */
+    unsigned char  *map_dirty;                       /* 每个IO单位一位的脏位图 */
+    /* 克隆：本镜像只存改写过的IO单位，其余从只读快照读出 */
+    int             base_fd;                         /* 快照镜像，-1表示不是克隆 */
+    char            base_path[DDRIVER_PATH_MAX];
+    unsigned char  *cow_map;                         /* 每个IO单位一位：已改写，从本镜像读 */
+    int             cow_dirty;                       /* 重定向表改变后尚未保存 */
+    char           *cow_path;
 };
 /******************************************************************************
 * SECTION: Global Variable
 *******************************************************************************/
-/* reference: https://en.wikipedia.org/wiki/Hard_disk_drive_performance_characteristics */
-struct ddriver disk = {
-    .read_cnt    = 0,
-    .write_cnt   = 0,
-    .seek_cnt    = 0,
+/* 新设备的初始状态，reference: https://en.wikipedia.org/wiki/Hard_disk_drive_performance_characteristics */
+static const struct ddriver disk_default = {
+    .head        = 0,
+    .map         = NULL,
+    .map_dirty   = NULL,
+    .base_fd     = -1,
     .read_lat    = 2,       /* 2ms */       
     .write_lat   = 1,       /* 1ms */
     .seek_lat    = 4,       /* 4.17ms per 360 degree */
+    .model       = { .type = DDRIVER_MODEL_LEGACY, .flush_lat_us = 4000 },
+    .flush_mode  = DDRIVER_FLUSH_EMULATE,
+    .clock_mode  = DDRIVER_CLOCK_REAL,
     .major_num   = 0,
     .track_num   = 100,
     .layout_size = CONFIG_DISK_SZ,
-    .iounit_size = CONFIG_BLOCK_SZ
+    .iounit_size = CONFIG_BLOCK_SZ,
+    .qdepth      = CONFIG_QDEPTH,
+    .parallel    = CONFIG_PARALLEL,
+    .sched       = { .type            = DDRIVER_SCHED_NOOP,
+                     .read_expire_us  = 500000,      /* 500ms */
+                     .write_expire_us = 5000000,     /* 5s */
+                     .writes_starved  = 2,
+                     .max_merge       = CONFIG_MAX_MERGE_SZ },
+    .sched_dir   = 1,
+};
+
+/* 已打开的设备，按ddriver_fd查找 */
+static struct ddriver *devs[CONFIG_MAX_DEVS];
+static pthread_mutex_t devs_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long clock_gen_next;                 /* 分配时钟纪元 */
+/******************************************************************************
+* SECTION: Helper Functions
+*******************************************************************************/
+int check_valid(struct ddriver *disk, size_t size) {
+    if (size != disk->iounit_size){
+        user_alert("io size %ld should align to %d", size, disk->iounit_size);
+        return -EIO;
+    }
+    return 0;
+}
+
+int check_valid_multi(struct ddriver *disk, size_t size) {
+    if (size == 0 || size % disk->iounit_size != 0){
+        user_alert("io size %ld should be multiple of %d", size, disk->iounit_size);
+        return -EIO;
+    }
+    return 0;
+}
+
+int check_align(struct ddriver *disk, off_t offset) {
+    if (!IS_ADDR_ALIGN(offset)) {
+        user_alert("offset %ld must be aligned to block size %d", 
+                      offset, disk->iounit_size);
+        return -EINVAL;
+    }
+    if (offset < 0 || offset >= disk->layout_size) {
+        user_alert("offset %ld out of device range", offset);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+int check_range(struct ddriver *disk, off_t offset, size_t size) {
+    if (offset + (off_t)size > disk->layout_size) {
+        user_alert("io %ld+%ld crosses device end %ld", offset, size, disk->layout_size);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/* 各设备类型的默认参数，参考常见7200rpm HDD、SATA SSD与NVMe SSD */
+static const struct ddriver_model model_presets[] = {
+    [DDRIVER_MODEL_LEGACY] = { .type = DDRIVER_MODEL_LEGACY, .flush_lat_us = 4000 },
+    [DDRIVER_MODEL_HDD]    = { .type = DDRIVER_MODEL_HDD, .read_lat_us = 100, .write_lat_us = 100,
+                               .seek_min_us = 500, .seek_max_us = 15000, .rpm = 7200,
+                               .bandwidth = 150ULL << 20, .flush_lat_us = 8000 },
+    [DDRIVER_MODEL_SSD]    = { .type = DDRIVER_MODEL_SSD, .read_lat_us = 50, .write_lat_us = 200,
+                               .page_size = 4096, .channels = 8, .bandwidth = 500ULL << 20,
+                               .flush_lat_us = 1000 },
+    [DDRIVER_MODEL_NVME]   = { .type = DDRIVER_MODEL_NVME, .read_lat_us = 10, .write_lat_us = 20,
+                               .page_size = 4096, .channels = 16, .qd_scale = 32,
+                               .bandwidth = 3000ULL << 20, .flush_lat_us = 200 },
+    [DDRIVER_MODEL_NONE]   = { .type = DDRIVER_MODEL_NONE },
 };
+static const char *model_names[] = { "legacy", "hdd", "ssd", "nvme", "none" };
+
+static long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+/**
+ * @brief 调用线程在该设备上的模拟时刻(virtual模式)
+ *        同一线程的同步请求在模拟时间上首尾相接，不同线程的请求可以重叠
+ */
+static long *vclock_thread(struct ddriver *disk) {
+    static __thread struct {
+        unsigned long gen;
+        long          now;
+    } vthreads[CONFIG_MAX_DEVS];
+
+    if (vthreads[disk->idx].gen != disk->clock_gen) {
+        vthreads[disk->idx].gen = disk->clock_gen;
+        vthreads[disk->idx].now = 0;
+    }
+    return &vthreads[disk->idx].now;
+}
+/**
+ * @brief 设备时间(us)：real模式为重新计时以来的墙上时间，virtual模式为模拟时钟
+ */
+static long dev_time(struct ddriver *disk) {
+    if (disk->clock_mode == DDRIVER_CLOCK_VIRTUAL)
+        return disk->vclock;
+    return now_us() - disk->clock_epoch;
+}
+/**
+ * @brief 设备时钟重新计时，调用者持有disk->lock或设备尚未登记
+ */
+static void clock_reset(struct ddriver *disk) {
+    disk->clock_gen     = __atomic_add_fetch(&clock_gen_next, 1, __ATOMIC_RELAXED);
+    disk->clock_epoch   = now_us();
+    disk->vclock        = 0;
+    disk->vfloor        = 0;
+    disk->vbusy_next    = 0;
+    disk->bw_busy_until = 0;
+    memset(disk->vbusy, 0, sizeof(disk->vbusy));
+}
+
+long rotate_lat_us(struct ddriver *disk, off_t start, off_t end) {
+    off_t bytes_per_track = disk->layout_size / disk->track_num;
+    int lat_per_track = disk->seek_lat;
+    off_t distance = llabs(end - start) % bytes_per_track; 
+
+    return distance * lat_per_track / bytes_per_track * 1000;
+}
+/**
+ * @brief 磁头从start移动到end的延迟(us)
+ *        HDD: seek曲线 min + (max - min) * sqrt(距离 / 全行程)，再加平均半圈旋转延迟
+ */
+static uint64_t isqrt(uint64_t x) {
+    uint64_t r = x, y = (x + 1) / 2;
+
+    while (y < r) {
+        r = y;
+        y = (r + x / r) / 2;
+    }
+    return r;
+}
+
+static long seek_lat_us(struct ddriver *disk, off_t start, off_t end) {
+    struct ddriver_model *m = &disk->model;
+    uint64_t frac;
+
+    switch (m->type)
+    {
+    case DDRIVER_MODEL_LEGACY:
+        return rotate_lat_us(disk, start, end);
+    case DDRIVER_MODEL_HDD:
+        if (start == end)
+            return 0;
+        frac = ((uint64_t)llabs(end - start) << 20) / disk->layout_size;   /* 2^20定点 */
+        return m->seek_min_us + (long)(((m->seek_max_us - m->seek_min_us) * isqrt(frac)) >> 10)
+               + (m->rpm ? 30000000L / m->rpm : 0);
+    default:                                          /* 无机械部件 */
+        return 0;
+    }
+}
+/**
+ * @brief 读写命令本身的延迟(us)，active为包括本请求在内正在服务的请求数
+ *        SSD: 按页计延迟，页与其他在服务请求分摊到channels个通道上
+ *        NVMe: 同SSD，队列深度超过qd_scale后延迟随深度线性增长
+ */
+static long op_lat_us(struct ddriver *disk, int op, size_t size, int active) {
+    struct ddriver_model *m = &disk->model;
+    long base, pages, waves, lat;
+
+    switch (m->type)
+    {
+    case DDRIVER_MODEL_LEGACY:
+        return (op == DDRIVER_OP_READ ? disk->read_lat : disk->write_lat) * 1000L;
+    case DDRIVER_MODEL_HDD:
+        return op == DDRIVER_OP_READ ? m->read_lat_us : m->write_lat_us;
+    case DDRIVER_MODEL_SSD:
+    case DDRIVER_MODEL_NVME:
+        base  = op == DDRIVER_OP_READ ? m->read_lat_us : m->write_lat_us;
+        pages = DIV_ROUND_UP(size, m->page_size ? m->page_size : disk->iounit_size);
+        waves = DIV_ROUND_UP(pages + active - 1, m->channels ? m->channels : 1);
+        lat   = base * waves;
+        if (m->type == DDRIVER_MODEL_NVME && m->qd_scale && active > m->qd_scale)
+            lat = lat * active / m->qd_scale;
+        return lat;
+    default:
+        return 0;
+    }
+}
+/**
+ * @brief 带宽上限：所有请求共享一个传输通道，返回本次传输需要等待的时间(us)
+ *        virtual模式下请求不按模拟时刻先后到达，只计传输时间，排队由并行度体现
+ */
+static long bw_lat_us(struct ddriver *disk, size_t size) {
+    long now, start, xfer;
+
+    if (disk->model.bandwidth == 0)
+        return 0;
+    xfer  = (long)((double)size * 1000000 / disk->model.bandwidth);
+    if (disk->clock_mode == DDRIVER_CLOCK_VIRTUAL)
+        return xfer;
+    now   = now_us();
+    start = disk->bw_busy_until > now ? disk->bw_busy_until : now;
+    disk->bw_busy_until = start + xfer;
+    return disk->bw_busy_until - now;
+}
+/**
+ * @brief log2分桶
+ */
+static int hist_bucket(uint64_t val) {
+    int i = 0;
+
+    while (val > 1 && i < DDRIVER_HIST_BUCKETS - 1) {
+        val >>= 1;
+        i++;
+    }
+    return i;
+}
+/**
+ * @brief 磁盘头移动到offset：计数、记录距离，返回seek延迟(us)，调用者需持有disk->lock
+ */
+static long account_seek(struct ddriver *disk, off_t offset) {
+    uint64_t dist = llabs(offset - disk->head);
+    long lat = seek_lat_us(disk, disk->head, offset);
+
+    INC_SEEKCNT(disk);
+    disk->stats.seek_dist += dist;
+    disk->stats.seek_dist_hist[hist_bucket(dist / disk->iounit_size)]++;
+    disk->head = offset;
+    return lat;
+}
+/******************************************************************************
+* SECTION: Device Cache
+* 以下函数均要求调用者持有disk->lock
+*******************************************************************************/
+#define CACHE_DIRTY(disk, blk)  ((disk)->cache_dirty[(blk) / 8] & (1 << ((blk) % 8)))
+/**
+ * @brief 把从blk起的nr个相邻IO单位写回介质：移动磁盘头，返回设备时间(us)
+ */
+static long cache_write_media(struct ddriver *disk, long blk, long nr) {
+    off_t offset = (off_t)blk * disk->iounit_size;
+    size_t size  = (size_t)nr * disk->iounit_size;
+    long lat = 0;
+
+    if (offset != disk->head)
+        lat += account_seek(disk, offset);
+    disk->head = offset + size;
+    lat += op_lat_us(disk, DDRIVER_OP_WRITE, size, 1);
+    if (disk->model.bandwidth)
+        lat += (long)((double)size * 1000000 / disk->model.bandwidth);
+    disk->stats.destage_cnt++;
+    disk->stats.destage_bytes += size;
+    return lat;
+}
+/**
+ * @brief 清除[blk, blk + nr)的脏位，FIFO中对应的条目留到出队时跳过
+ */
+static void cache_clean(struct ddriver *disk, long blk, long nr) {
+    for (; nr > 0 && disk->cache_dirty_cnt > 0; blk++, nr--) {
+        if (CACHE_DIRTY(disk, blk)) {
+            disk->cache_dirty[blk / 8] &= ~(1 << (blk % 8));
+            disk->cache_dirty_cnt--;
+        }
+    }
+}
+/**
+ * @brief 把区间内的脏IO单位按相邻的段写回，返回设备时间(us)
+ */
+static long cache_destage_range(struct ddriver *disk, long blk, long end) {
+    long nr, lat = 0;
+
+    for (; blk < end && disk->cache_dirty_cnt > 0; blk += nr) {
+        if (!CACHE_DIRTY(disk, blk)) {
+            nr = 1;
+            continue;
+        }
+        for (nr = 1; blk + nr < end && CACHE_DIRTY(disk, blk + nr); nr++)
+            ;
+        cache_clean(disk, blk, nr);
+        lat += cache_write_media(disk, blk, nr);
+    }
+    return lat;
+}
+/**
+ * @brief 写回最早写入的脏IO单位，连同其后相邻的脏IO单位一起写回，返回设备时间(us)
+ */
+static long cache_destage_oldest(struct ddriver *disk) {
+    long nblks = disk->layout_size / disk->iounit_size;
+    long blk = -1, nr;
+
+    while (disk->cache_used > 0 && blk < 0) {
+        blk = disk->cache_fifo[disk->cache_head];
+        disk->cache_head = (disk->cache_head + 1) % disk->cache_cap;
+        disk->cache_used--;
+        if (!CACHE_DIRTY(disk, blk))                 /* 已被FUA或刷写写回 */
+            blk = -1;
+    }
+    if (blk < 0)
+        return 0;
+    for (nr = 1; blk + nr < nblks && CACHE_DIRTY(disk, blk + nr); nr++)
+        ;
+    cache_clean(disk, blk, nr);
+    return cache_write_media(disk, blk, nr);
+}
+/**
+ * @brief 刷写屏障：按偏移顺序写回全部脏数据，返回设备时间(us)
+ */
+static long cache_destage_all(struct ddriver *disk) {
+    long lat = cache_destage_range(disk, 0, disk->layout_size / disk->iounit_size);
+
+    disk->cache_head = 0;
+    disk->cache_used = 0;
+    disk->stats.destage_stall_us += lat;
+    return lat;
+}
+/**
+ * @brief 空闲时后台写回：设备空闲超过idle_us后开始写回最老的脏数据，直到本请求到达
+ *        最后一次写回超出空闲时间的部分由本请求等待，返回这部分时间(us)
+ */
+static long cache_destage_idle(struct ddriver *disk) {
+    long now = disk->clock_mode == DDRIVER_CLOCK_VIRTUAL ? *vclock_thread(disk) : now_us();
+    long budget = now - disk->cache_idle_since - disk->cache.idle_us;
+
+    disk->cache_idle_since = now;
+    if (budget <= 0)
+        return 0;
+    while (budget > 0 && disk->cache_dirty_cnt > 0)
+        budget -= cache_destage_oldest(disk);
+    if (budget >= 0)
+        return 0;
+    disk->stats.destage_stall_us -= budget;
+    return -budget;
+}
+/**
+ * @brief 写入缓存：缓存满时先写回最老的数据，返回设备时间(us)
+ */
+static long cache_write(struct ddriver *disk, off_t offset, size_t size) {
+    long blk, stall = 0;
+
+    for (blk = offset / disk->iounit_size; blk < (long)((offset + size) / disk->iounit_size); blk++) {
+        if (CACHE_DIRTY(disk, blk))                  /* 覆盖缓存中尚未写回的数据 */
+            continue;
+        while (disk->cache_used == disk->cache_cap)
+            stall += cache_destage_oldest(disk);
+        disk->cache_fifo[(disk->cache_head + disk->cache_used) % disk->cache_cap] = blk;
+        disk->cache_used++;
+        disk->cache_dirty[blk / 8] |= 1 << (blk % 8);
+        disk->cache_dirty_cnt++;
+    }
+    disk->stats.cache_writes++;
+    disk->stats.destage_stall_us += stall;
+    return stall + disk->cache.write_lat_us + bw_lat_us(disk, size);
+}
+/**
+ * @brief 读请求的IO单位是否都在缓存中
+ */
+static int cache_hit(struct ddriver *disk, off_t offset, size_t size) {
+    long blk;
+
+    if (disk->cache_dirty_cnt == 0)
+        return 0;
+    for (blk = offset / disk->iounit_size; blk < (long)((offset + size) / disk->iounit_size); blk++) {
+        if (!CACHE_DIRTY(disk, blk))
+            return 0;
+    }
+    return 1;
+}
+/**
+ * @brief 记账一次定位请求：移动磁盘头、计数，返回应付出的设备延迟(us)
+ *        调用者需持有disk->lock，睡眠放在锁外，使并发请求的延迟可以重叠
+ */
+static long account_io(struct ddriver *disk, int op, off_t offset, size_t size) {
+    long lat = 0;
+    uint64_t qd = disk->in_service;
+
+    if (disk->cache_cap && disk->cache.policy == DDRIVER_DESTAGE_IDLE && qd == 1)
+        lat += cache_destage_idle(disk);
+
+    if (disk->cache_cap && op == DDRIVER_OP_WRITE) {
+        lat += cache_write(disk, offset, size);
+    }
+    else if (disk->cache_cap && cache_hit(disk, offset, size)) {
+        disk->stats.cache_read_hits++;
+        lat += disk->cache.read_lat_us + bw_lat_us(disk, size);
+    }
+    else {
+        if (disk->cache_cap)
+            disk->stats.cache_read_misses++;
+        if (offset != disk->head)
+            lat += account_seek(disk, offset);
+        disk->head = offset + size;
+        lat += op_lat_us(disk, op, size, qd);
+        lat += bw_lat_us(disk, size);
+    }
+
+    if (op == DDRIVER_OP_READ) {
+        INC_READCNT(disk);
+        disk->stats.read_bytes  += size;
+        disk->stats.read_lat_us += lat;
+        disk->stats.read_lat_hist[hist_bucket(lat)]++;
+    }
+    else {
+        INC_WRITECNT(disk);
+        disk->stats.write_bytes  += size;
+        disk->stats.write_lat_us += lat;
+        disk->stats.write_lat_hist[hist_bucket(lat)]++;
+    }
+    disk->stats.qd_samples++;
+    disk->stats.qd_sum += qd;
+    if (qd > disk->stats.qd_max)
+        disk->stats.qd_max = qd;
+    disk->stats.qd_hist[hist_bucket(qd)]++;
+    return lat;
+}
+/**
+ * @brief 付出延迟：real模式睡眠并统计实际睡眠时间，virtual模式只推进调用线程的模拟时刻
+ * 
+ * @return long 付出的时间(us)
+ */
+static long dev_sleep(struct ddriver *disk, long lat) {
+    long start;
+
+    if (lat <= 0)
+        return 0;
+    if (disk->clock_mode == DDRIVER_CLOCK_VIRTUAL) {
+        *vclock_thread(disk) += lat;
+        __atomic_fetch_add(&disk->stats.sleep_us, lat, __ATOMIC_RELAXED);
+        return lat;
+    }
+    start = now_us();
+    usleep(lat);
+    lat = now_us() - start;
+    __atomic_fetch_add(&disk->stats.sleep_us, lat, __ATOMIC_RELAXED);
+    return lat;
+}
+/**
+ * @brief 记录一条请求，未开启trace时为空操作
+ */
+static void trace_io(struct ddriver *disk, int op, int flags, off_t offset, uint64_t size, 
+                     uint32_t cmd) {
+    struct ddriver_trace_rec rec;
+
+    if (disk->trace == NULL)
+        return;
+    rec.ts_us  = now_us() - disk->trace_start;
+    rec.offset = offset;
+    rec.size   = size;
+    rec.tid    = syscall(SYS_gettid);
+    rec.op     = op;
+    rec.flags  = flags;
+    rec.cmd    = cmd;
+    rec.reserved = 0;
+    pthread_mutex_lock(&disk->trace_lock);
+    fwrite(&rec, sizeof(rec), 1, disk->trace);
+    pthread_mutex_unlock(&disk->trace_lock);
+}
+/**
+ * @brief 请求区间是否与正在服务的请求冲突：写和丢弃与任何请求重叠都要串行，读读可以并行
+ */
+static int svc_conflict(struct ddriver *disk, int op, off_t start, off_t end) {
+    int i;
+
+    for (i = 0; i < CONFIG_MAX_PARALLEL; i++) {
+        if (disk->svc[i].used && start < disk->svc[i].end && disk->svc[i].start < end &&
+            (op != DDRIVER_OP_READ || disk->svc[i].op != DDRIVER_OP_READ))
+            return 1;
+    }
+    return 0;
+}
+/**
+ * @brief virtual模式：不早于t、且设备上同时服务的请求数小于并行度的最早模拟时刻
+ *        候选时刻为t和最近请求的结束时刻，调用者持有disk->lock
+ */
+static long vclock_fit(struct ddriver *disk, long t) {
+    long cand, best = -1;
+    int i, j, busy;
+
+    for (i = -1; i < CONFIG_VBUSY; i++) {
+        cand = i < 0 ? t : disk->vbusy[i].end;
+        if (cand < t || (best >= 0 && cand >= best))
+            continue;
+        busy = 0;
+        for (j = 0; j < CONFIG_VBUSY; j++) {
+            if (disk->vbusy[j].start <= cand && cand < disk->vbusy[j].end)
+                busy += disk->vbusy[j].width;
+        }
+        if (busy < disk->parallel)
+            best = cand;
+    }
+    return best;                                     /* 最晚的结束时刻一定空闲，不会返回-1 */
+}
+/**
+ * @brief virtual模式下请求开始：从调用线程的模拟时刻起找设备有空闲并行度的时刻
+ *        刷写屏障要等已记录的请求全部结束，调用者持有disk->lock
+ */
+static void vclock_start(struct ddriver *disk, int slot, int op) {
+    long *now = vclock_thread(disk);
+    long t = *now > disk->vfloor ? *now : disk->vfloor;
+    int i;
+
+    if (op == OP_FLUSH) {
+        for (i = 0; i < CONFIG_VBUSY; i++) {
+            if (disk->vbusy[i].end > t)
+                t = disk->vbusy[i].end;
+        }
+    }
+    else {
+        t = vclock_fit(disk, t);
+    }
+    *now = t;
+    disk->svc[slot].vstart = t;
+}
+/**
+ * @brief virtual模式下请求结束：记录占用的时间段，淘汰最老的一段，调用者持有disk->lock
+ */
+static void vclock_end(struct ddriver *disk, int slot) {
+    struct ddriver_vbusy *busy = &disk->vbusy[disk->vbusy_next];
+    long now = *vclock_thread(disk);
+
+    if (busy->width && disk->vfloor < busy->end)
+        disk->vfloor = busy->end;
+    busy->start = disk->svc[slot].vstart;
+    busy->end   = now;
+    busy->width = disk->svc[slot].op == OP_FLUSH ? CONFIG_MAX_PARALLEL : 1;
+    disk->vbusy_next = (disk->vbusy_next + 1) % CONFIG_VBUSY;
+    if (disk->vclock < now)
+        disk->vclock = now;
+}
+/**
+ * @brief 开始服务一个请求：等到有空闲的并行槽且不与在服务的请求冲突，
+ *        再按服务顺序记账移动磁盘头
+ * 
+ * @param lat 输出应付出的设备延迟(us)
+ * @return int 占用的槽，服务结束时交给svc_exit
+ */
+static int svc_enter(struct ddriver *disk, int op, off_t offset, size_t size, long *lat) {
+    int slot;
+
+    pthread_mutex_lock(&disk->lock);
+    while (disk->in_service >= disk->parallel || 
+           svc_conflict(disk, op, offset, offset + size))
+        pthread_cond_wait(&disk->svc_cond, &disk->lock);
+    for (slot = 0; disk->svc[slot].used; slot++)
+        ;
+    disk->svc[slot].used  = 1;
+    disk->svc[slot].op    = op;
+    disk->svc[slot].start = offset;
+    disk->svc[slot].end   = offset + size;
+    disk->in_service++;
+    if (disk->clock_mode == DDRIVER_CLOCK_VIRTUAL)
+        vclock_start(disk, slot, op);
+    if (op == OP_SEEK) {
+        *lat = account_seek(disk, offset);
+    }
+    else if (op == OP_DISCARD) {                     /* 只改映射表，不移动磁盘头，不计延迟 */
+        disk->stats.discard_cnt++;
+        disk->stats.discard_bytes += size;
+        if (disk->cache_cap)                         /* 被丢弃的数据不必再写回 */
+            cache_clean(disk, offset / disk->iounit_size, size / disk->iounit_size);
+        *lat = 0;
+    }
+    else if (op == OP_FLUSH) {                       /* 先写回设备缓存，再由dev_persist按刷写模式落盘 */
+        disk->stats.flush_cnt++;
+        *lat = disk->cache_cap ? cache_destage_all(disk) : 0;
+    }
+    else {
+        *lat = account_io(disk, op, offset, size);
+    }
+    pthread_mutex_unlock(&disk->lock);
+    return slot;
+}
+/**
+ * @brief 结束服务，唤醒等待的请求
+ */
+static void svc_exit(struct ddriver *disk, int slot) {
+    pthread_mutex_lock(&disk->lock);
+    if (disk->clock_mode == DDRIVER_CLOCK_VIRTUAL)
+        vclock_end(disk, slot);
+    if (disk->cache_cap) 
+        disk->cache_idle_since = disk->clock_mode == DDRIVER_CLOCK_VIRTUAL ? 
+                                 *vclock_thread(disk) : now_us();
+    disk->svc[slot].used = 0;
+    disk->in_service--;
+    pthread_cond_broadcast(&disk->svc_cond);
+    pthread_mutex_unlock(&disk->lock);
+}
+/******************************************************************************
+* SECTION: Clone Overlay
+* 克隆设备的读按重定向表分别从本镜像或快照读出；写总是整IO单位，直接写本镜像再置位，
+* 不需要先从快照拷贝
+*******************************************************************************/
+#define COW_MAPPED(disk, blk)   ((disk)->cow_map[(blk) / 8] & (1 << ((blk) % 8)))
+
+/**
+ * @brief 标记区间已改写，之后从本镜像读；调用者已检查区间，这里仍截断到设备末尾，不写出重定向表
+ */
+static void cow_mark(struct ddriver *disk, off_t offset, off_t len) {
+    long blk, end = (offset + len) / disk->iounit_size;
+
+    if (end > disk->layout_size / disk->iounit_size)
+        end = disk->layout_size / disk->iounit_size;
+    pthread_mutex_lock(&disk->lock);
+    for (blk = offset / disk->iounit_size; blk < end; blk++)
+        disk->cow_map[blk / 8] |= 1 << (blk % 8);
+    disk->cow_dirty = 1;
+    pthread_mutex_unlock(&disk->lock);
+}
+/**
+ * @brief 克隆设备的读：按重定向表切成连续段，分别从本镜像或快照读
+ *        区间内的位只会被与本请求冲突的写改变，不必加锁
+ */
+static ssize_t cow_pread(struct ddriver *disk, int fd, char *buf, size_t size, off_t offset) {
+    long first = offset / disk->iounit_size, last = (offset + size) / disk->iounit_size;
+    long blk, end;
+    int mapped;
+
+    for (blk = first; blk < last; blk = end) {
+        mapped = COW_MAPPED(disk, blk) != 0;
+        for (end = blk + 1; end < last && (COW_MAPPED(disk, end) != 0) == mapped; end++)
+            ;
+        if (pread(mapped ? fd : disk->base_fd, buf + (blk - first) * disk->iounit_size,
+                  (end - blk) * disk->iounit_size, (off_t)blk * disk->iounit_size) < 0)
+            return -1;
+    }
+    return size;
+}
+/**
+ * @brief 读写镜像，克隆设备经重定向表
+ */
+static ssize_t img_rw(struct ddriver *disk, int fd, int op, struct iovec *iov, int nr, 
+                      off_t offset) {
+    ssize_t ret = 0;
+    int i;
+
+    if (op == DDRIVER_OP_WRITE) {
+        ret = pwritev(fd, iov, nr, offset);
+        if (ret > 0 && disk->base_fd >= 0)
+            cow_mark(disk, offset, ret);
+        return ret;
+    }
+    if (disk->base_fd < 0)
+        return preadv(fd, iov, nr, offset);
+    for (i = 0; i < nr; i++) {
+        if (cow_pread(disk, fd, iov[i].iov_base, iov[i].iov_len, offset + ret) < 0)
+            return -1;
+        ret += iov[i].iov_len;
+    }
+    return ret;
+}
+/**
+ * @brief 镜像区间打洞，读回全0；文件系统不支持打洞时退回写0，整个设备时退回截断再扩展
+ */
+static int img_punch(struct ddriver *disk, off_t offset, off_t len) {
+    static const char zero[4096];
+    off_t done;
+
+    if (fallocate(disk->ddriver_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 
+                  offset, len) == 0)
+        return 0;
+    if (errno != EOPNOTSUPP && errno != ENOSYS) {
+        user_panic("fallocate error: %s", strerror(errno));
+        return -EIO;
+    }
+    if (offset == 0 && len == disk->layout_size) {
+        if (ftruncate(disk->ddriver_fd, 0) < 0 || 
+            ftruncate(disk->ddriver_fd, disk->layout_size) < 0)
+            return -EIO;
+        return 0;
+    }
+    for (done = 0; done < len; done += sizeof(zero)) {
+        if (pwrite(disk->ddriver_fd, zero, 
+                   len - done < (off_t)sizeof(zero) ? len - done : (off_t)sizeof(zero),
+                   offset + done) < 0)
+            return -EIO;
+    }
+    return 0;
+}
+/**
+ * @brief 拷贝[start, end)，sparse时跳过源文件中的洞
+ */
+static int img_copy(int src, int dst, off_t start, off_t end, int sparse) {
+    char buf[64 * 1024];
+    off_t pos, data, hole;
+    ssize_t n;
+
+    for (pos = start; pos < end; pos = hole) {
+        data = sparse ? lseek(src, pos, SEEK_DATA) : pos;
+        if (data < 0 && errno == ENXIO)              /* 之后全是洞 */
+            break;
+        if (data < 0)                                /* 不支持SEEK_DATA，整段拷贝 */
+            data = pos;
+        hole = sparse ? lseek(src, data, SEEK_HOLE) : end;
+        if (hole < 0 || hole > end)
+            hole = end;
+        for (; data < hole; data += n) {
+            n = pread(src, buf, hole - data < (off_t)sizeof(buf) ? hole - data : (off_t)sizeof(buf),
+                      data);
+            if (n <= 0 || pwrite(dst, buf, n, data) != n)
+                return -EIO;
+        }
+    }
+    return 0;
+}
+/**
+ * @brief 保存重定向表，克隆之后的打开据此找回快照
+ */
+static int cow_save(struct ddriver *disk) {
+    struct ddriver_cow_hdr hdr;
+    long nblks = disk->layout_size / disk->iounit_size;
+    FILE *f;
+    int ret = 0;
+
+    if (disk->base_fd < 0 || !disk->cow_dirty)
+        return 0;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic       = COW_MAGIC;
+    hdr.iounit_size = disk->iounit_size;
+    hdr.layout_size = disk->layout_size;
+    strcpy(hdr.base, disk->base_path);
+    f = fopen(disk->cow_path, "w");
+    if (f == NULL)
+        return -EIO;
+    pthread_mutex_lock(&disk->lock);
+    if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 || 
+        fwrite(disk->cow_map, (nblks + 7) / 8, 1, f) != 1)
+        ret = -EIO;
+    else
+        disk->cow_dirty = 0;
+    pthread_mutex_unlock(&disk->lock);
+    if (fclose(f) != 0)
+        ret = -EIO;
+    if (ret < 0)
+        user_panic("can't save clone map: %s", disk->cow_path);
+    return ret;
+}
+/**
+ * @brief 挂上快照，调用者保证没有请求在服务
+ */
+static int cow_attach(struct ddriver *disk, int base_fd, const char *base_path, 
+                      unsigned char *cow_map) {
+    disk->base_fd = base_fd;
+    strcpy(disk->base_path, base_path);
+    disk->cow_map = cow_map;
+    disk->cow_dirty = 1;
+    return cow_save(disk);
+}
+/**
+ * @brief 摘下快照，设备成为普通镜像，调用者保证没有请求在服务
+ */
+static void cow_detach(struct ddriver *disk) {
+    if (disk->base_fd < 0)
+        return;
+    close(disk->base_fd);
+    free(disk->cow_map);
+    disk->base_fd = -1;
+    disk->cow_map = NULL;
+    disk->cow_dirty = 0;
+    unlink(disk->cow_path);
+}
+/**
+ * @brief 打开只读快照，大小须与设备一致
+ */
+static int cow_open_base(struct ddriver *disk, const char *path) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+        user_alert("can't open snapshot [%s]: %s", path, strerror(errno));
+        return -errno;
+    }
+    fstat(fd, &st);
+    if (st.st_size != disk->layout_size || 
+        (st.st_dev == disk->st_dev && st.st_ino == disk->st_ino)) {
+        user_alert("snapshot [%s] doesn't match device", path);
+        close(fd);
+        return -EINVAL;
+    }
+    return fd;
+}
+/**
+ * @brief 打开时按重定向表恢复克隆，没有重定向表则是普通镜像
+ */
+static int cow_load(struct ddriver *disk) {
+    struct ddriver_cow_hdr hdr;
+    long nblks = disk->layout_size / disk->iounit_size;
+    unsigned char *cow_map;
+    FILE *f;
+    int fd, ret = 0;
+
+    f = fopen(disk->cow_path, "r");
+    if (f == NULL)
+        return 0;
+    cow_map = (unsigned char *)malloc((nblks + 7) / 8);
+    if (cow_map == NULL) {
+        fclose(f);
+        return -ENOMEM;
+    }
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.magic != COW_MAGIC ||
+        hdr.iounit_size != (uint32_t)disk->iounit_size || 
+        hdr.layout_size != (uint64_t)disk->layout_size ||
+        fread(cow_map, (nblks + 7) / 8, 1, f) != 1) {
+        user_panic("bad clone map: %s", disk->cow_path);
+        ret = -EINVAL;
+    }
+    fclose(f);
+    hdr.base[DDRIVER_PATH_MAX - 1] = '\0';
+    fd = ret < 0 ? ret : cow_open_base(disk, hdr.base);
+    if (fd < 0) {
+        free(cow_map);
+        return fd;
+    }
+    disk->base_fd = fd;
+    strcpy(disk->base_path, hdr.base);
+    disk->cow_map = cow_map;
+    return 0;
+}
+/**
+ * @brief 丢弃区间：打洞让镜像保持稀疏，之后读回全0
+ *        克隆设备丢弃的区间改从本镜像读；丢弃整个设备时摘下快照
+ */
+static int dev_discard(struct ddriver *disk, off_t offset, off_t len) {
+    off_t blk;
+    long lat;
+    int slot, ret;
+
+    if (len <= 0 || !IS_ADDR_ALIGN(offset) || len % disk->iounit_size != 0 ||
+        offset < 0 || offset + len > disk->layout_size) {
+        user_alert("invalid discard range %ld+%ld", offset, len);
+        return -EINVAL;
+    }
+
+    slot = svc_enter(disk, OP_DISCARD, offset, len, &lat);
+    ret = img_punch(disk, offset, len);
+    if (ret == 0 && disk->base_fd >= 0) {
+        if (offset == 0 && len == disk->layout_size)
+            cow_detach(disk);
+        else
+            cow_mark(disk, offset, len);
+    }
+    if (disk->map_dirty) {                           /* 被丢弃的IO单位不必再写回 */
+        pthread_mutex_lock(&disk->lock);
+        for (blk = offset / disk->iounit_size; blk < (offset + len) / disk->iounit_size; blk++)
+            disk->map_dirty[blk / 8] &= ~(1 << (blk % 8));
+        pthread_mutex_unlock(&disk->lock);
+    }
+    svc_exit(disk, slot);
+    return ret;
+}
+/**
+ * @brief 设置延迟模型
+ */
+static int set_model(struct ddriver *disk, const struct ddriver_model *model) {
+    if (model->type < 0 || model->type >= DDRIVER_MODEL_MAX)
+        return -EINVAL;
+    pthread_mutex_lock(&disk->lock);
+    disk->model = *model;
+    disk->bw_busy_until = 0;
+    pthread_mutex_unlock(&disk->lock);
+    return 0;
+}
+/**
+ * @brief 按刷写模式让已完成的写落盘，调用者持有服务槽
+ */
+static int dev_persist(struct ddriver *disk) {
+    long start = now_us(), paid = 0;
+    int ret = 0;
+
+    switch (disk->flush_mode)
+    {
+    case DDRIVER_FLUSH_EMULATE:                       /* 模拟了设备缓存时刷写的代价就是写回 */
+        if (disk->cache_cap == 0)
+            paid = dev_sleep(disk, disk->model.flush_lat_us);
+        break;
+    case DDRIVER_FLUSH_FDATASYNC:                     /* 真实落盘的耗时不计入模拟时钟 */
+        ret = fdatasync(disk->ddriver_fd);
+        paid = now_us() - start;
+        break;
+    case DDRIVER_FLUSH_FSYNC:
+        ret = fsync(disk->ddriver_fd);
+        paid = now_us() - start;
+        break;
+    default:
+        break;
+    }
+    __atomic_fetch_add(&disk->stats.flush_us, paid, __ATOMIC_RELAXED);
+    if (ret < 0) {
+        user_panic("flush error: %s", strerror(errno));
+        return -EIO;
+    }
+    return 0;
+}
+/**
+ * @brief 刷写屏障：等在服务的请求全部完成，刷写期间挡住新请求
+ */
+static int dev_flush(struct ddriver *disk) {
+    long lat;
+    int slot, ret;
+
+    slot = svc_enter(disk, OP_FLUSH, 0, disk->layout_size, &lat);
+    dev_sleep(disk, lat);
+    ret = dev_persist(disk);
+    if (ret == 0)
+        ret = cow_save(disk);
+    svc_exit(disk, slot);
+    return ret;
+}
+/**
+ * @brief 保存只读快照：刷写屏障内把设备内容拷到path，能reflink时不拷贝数据，
+ *        否则只拷贝有数据的区间；先写到临时文件再改名，已有的克隆仍持有旧快照
+ */
+static int dev_snapshot(struct ddriver *disk, const char *path) {
+    char tmp[DDRIVER_PATH_MAX + 8];
+    long nblks = disk->layout_size / disk->iounit_size;
+    long blk, end, lat;
+    struct stat st;
+    int dst, slot, ret = 0;
+
+    if (strnlen(path, DDRIVER_PATH_MAX) == DDRIVER_PATH_MAX || *path == '\0')
+        return -EINVAL;
+    if (stat(path, &st) == 0 && st.st_dev == disk->st_dev && st.st_ino == disk->st_ino)
+        return -EINVAL;                              /* 不能覆盖设备自己的镜像 */
+    if (disk->map && ddriver_flush_map(disk->ddriver_fd) < 0)
+        return -EIO;
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    unlink(tmp);
+    dst = open(tmp, O_CREAT | O_EXCL | O_WRONLY, 0644);
+    if (dst < 0) {
+        user_alert("can't create snapshot [%s]: %s", tmp, strerror(errno));
+        return -errno;
+    }
+
+    slot = svc_enter(disk, OP_FLUSH, 0, disk->layout_size, &lat);
+    dev_sleep(disk, lat);
+    if (ftruncate(dst, disk->layout_size) < 0)
+        ret = -EIO;
+#ifdef FICLONE
+    else if (ioctl(dst, FICLONE, disk->base_fd >= 0 ? disk->base_fd : disk->ddriver_fd) == 0)
+        ;
+#endif
+    else
+        ret = img_copy(disk->base_fd >= 0 ? disk->base_fd : disk->ddriver_fd, dst, 
+                       0, disk->layout_size, 1);
+    for (blk = 0; ret == 0 && disk->base_fd >= 0 && blk < nblks; blk = end) {
+        if (!COW_MAPPED(disk, blk)) {                /* 克隆改写过的IO单位覆盖到快照上 */
+            end = blk + 1;
+            continue;
+        }
+        for (end = blk + 1; end < nblks && COW_MAPPED(disk, end); end++)
+            ;
+        ret = img_copy(disk->ddriver_fd, dst, (off_t)blk * disk->iounit_size, 
+                       (off_t)end * disk->iounit_size, 0);
+    }
+    svc_exit(disk, slot);
+
+    if (ret == 0 && (fsync(dst) < 0 || fchmod(dst, 0444) < 0))
+        ret = -EIO;
+    close(dst);
+    if (ret == 0 && rename(tmp, path) < 0)
+        ret = -errno;
+    if (ret < 0) {
+        user_panic("snapshot [%s] failed: %s", path, strerror(-ret));
+        unlink(tmp);
+    }
+    return ret;
+}
+/**
+ * @brief 把设备变成快照的克隆：丢弃原有内容，之后未改写的IO单位都从快照读
+ *        建立了镜像映射或有异步请求未收割时不能克隆
+ */
+static int dev_clone(struct ddriver *disk, const char *path) {
+    char base_path[PATH_MAX];
+    unsigned char *cow_map;
+    long lat;
+    int fd, slot, busy, ret;
+
+    if (strnlen(path, DDRIVER_PATH_MAX) == DDRIVER_PATH_MAX || 
+        realpath(path, base_path) == NULL || strlen(base_path) >= DDRIVER_PATH_MAX)
+        return -EINVAL;
+    pthread_mutex_lock(&disk->lock);
+    busy = disk->map != NULL || disk->inflight > 0;
+    pthread_mutex_unlock(&disk->lock);
+    if (busy)
+        return -EBUSY;
+    fd = cow_open_base(disk, base_path);
+    if (fd < 0)
+        return fd;
+    cow_map = (unsigned char *)calloc((disk->layout_size / disk->iounit_size + 7) / 8, 1);
+    if (cow_map == NULL) {
+        close(fd);
+        return -ENOMEM;
+    }
+
+    slot = svc_enter(disk, OP_DISCARD, 0, disk->layout_size, &lat);  /* 按丢弃整个设备记账 */
+    cow_detach(disk);
+    ret = img_punch(disk, 0, disk->layout_size);
+    if (ret == 0) {
+        ret = cow_attach(disk, fd, base_path, cow_map);
+    }
+    else {
+        close(fd);
+        free(cow_map);
+    }
+    svc_exit(disk, slot);
+    return ret;
+}
+/**
+ * @brief 写请求的FUA：在服务槽内让本次写落盘，设备缓存中的这段数据先写回
+ */
+static int dev_fua(struct ddriver *disk, off_t offset, size_t size) {
+    long lat = 0;
+
+    pthread_mutex_lock(&disk->lock);
+    disk->stats.fua_cnt++;
+    if (disk->cache_cap) {
+        lat = cache_destage_range(disk, offset / disk->iounit_size, 
+                                  (offset + size) / disk->iounit_size);
+        disk->stats.destage_stall_us += lat;
+    }
+    pthread_mutex_unlock(&disk->lock);
+    dev_sleep(disk, lat);
+    return dev_persist(disk);
+}
+/**
+ * @brief 定位读写的公共路径，同步pread/pwrite与异步worker共用
+ *        flags: DDRIVER_REQ_PREFLUSH先刷写，DDRIVER_REQ_FUA写完即落盘
+ */
+static int do_io(struct ddriver *disk, int fd, int op, char *buf, size_t size, off_t offset,
+                 int flags) {
+    struct iovec iov;
+    ssize_t ret;
+    long lat;
+    int slot;
+    int res = check_valid_multi(disk, size);
+    if (res < 0)
+        return res;
+    res = check_align(disk, offset);
+    if (res < 0)
+        return res;
+    res = check_range(disk, offset, size);           /* 越过设备末尾的请求会写出位图、撑大镜像 */
+    if (res < 0)
+        return res;
+
+    if (op == DDRIVER_OP_WRITE && (flags & DDRIVER_REQ_PREFLUSH) && dev_flush(disk) < 0)
+        return -EIO;
+
+    iov.iov_base = buf;
+    iov.iov_len  = size;
+    slot = svc_enter(disk, op, offset, size, &lat);
+    dev_sleep(disk, lat);
+    ret = img_rw(disk, fd, op, &iov, 1, offset);
+    if (ret >= 0 && op == DDRIVER_OP_WRITE && (flags & DDRIVER_REQ_FUA) && 
+        dev_fua(disk, offset, size) < 0)
+        ret = -1;
+    svc_exit(disk, slot);
+    if (ret < 0) {
+        user_panic("%s error: %s", op == DDRIVER_OP_READ ? "pread" : "pwrite",
+                   strerror(errno));
+        return -EIO;
+    }
+    return size;
+}
+/**
+ * @brief 服务一组已按偏移排好、首尾相接的同向请求：只付出一次延迟，一次preadv/pwritev
+ */
+static void do_merged_io(struct ddriver *disk, int fd, struct ddriver_req **batch, int nr) {
+    struct iovec iov[SCHED_MAX_MERGE];
+    size_t total = 0;
+    ssize_t ret;
+    long lat;
+    int i, slot, flags = 0, op = batch[0]->op;
+
+    for (i = 0; i < nr; i++) {
+        iov[i].iov_base = batch[i]->buf;
+        iov[i].iov_len  = batch[i]->size;
+        total += batch[i]->size;
+        flags |= batch[i]->flags;                    /* 任一请求的标志作用于整批 */
+    }
+
+    if (op == DDRIVER_OP_WRITE && (flags & DDRIVER_REQ_PREFLUSH) && dev_flush(disk) < 0) {
+        for (i = 0; i < nr; i++)
+            batch[i]->res = -EIO;
+        return;
+    }
+
+    slot = svc_enter(disk, op, batch[0]->offset, total, &lat);
+    dev_sleep(disk, lat);
+    ret = img_rw(disk, fd, op, iov, nr, batch[0]->offset);
+    if (ret >= 0 && op == DDRIVER_OP_WRITE && (flags & DDRIVER_REQ_FUA) && 
+        dev_fua(disk, batch[0]->offset, total) < 0)
+        ret = -1;
+    svc_exit(disk, slot);
+    if (ret < 0)
+        user_panic("%s error: %s", op == DDRIVER_OP_READ ? "preadv" : "pwritev",
+                   strerror(errno));
+    for (i = 0; i < nr; i++)
+        batch[i]->res = ret < 0 ? -EIO : (int)batch[i]->size;
+}
+/**
+ * @brief 顺序读写：原子地占用当前位置起的size字节，再走定位读写路径
+ */
+static int seq_io(struct ddriver *disk, int op, char *buf, size_t size) {
+    off_t offset;
+    int ret;
+
+    pthread_mutex_lock(&disk->lock);
+    offset = disk->pos;
+    disk->pos += size;
+    pthread_mutex_unlock(&disk->lock);
+
+    trace_io(disk, TRACE_OP(op), 0, offset, size, 0);
+    ret = do_io(disk, disk->ddriver_fd, op, buf, size, offset, 0);
+    if (ret < 0) {
+        pthread_mutex_lock(&disk->lock);
+        if (disk->pos == offset + (off_t)size)        /* 没有其他线程推进过则回退 */
+            disk->pos = offset;
+        pthread_mutex_unlock(&disk->lock);
+    }
+    return ret;
+}
+/******************************************************************************
+* SECTION: IO Scheduler
+* 以下函数均要求调用者持有disk->lock
+*******************************************************************************/
+static const char *sched_names[] = { "noop", "elevator", "deadline" };
+static const char *flush_names[] = { "none", "emulate", "fdatasync", "fsync" };
+static const char *clock_names[] = { "real", "virtual" };
+/**
+ * @brief 请求是否合法，不合法的请求不参与合并，单独服务时由do_io报错
+ */
+static int sched_req_valid(struct ddriver *disk, struct ddriver_req *req) {
+    return req->size > 0 && req->size % disk->iounit_size == 0 &&
+           IS_ADDR_ALIGN(req->offset) && req->offset >= 0 &&
+           req->offset + (off_t)req->size <= disk->layout_size;
+}
+/**
+ * @brief 从等待队列中摘除一个请求
+ */
+static void sched_unlink(struct ddriver *disk, struct ddriver_req *req) {
+    struct ddriver_req *prev = NULL, *cur = disk->pending_head;
+
+    while (cur && cur != req) {
+        prev = cur;
+        cur = cur->next;
+    }
+    if (cur == NULL)
+        return;
+    if (prev)
+        prev->next = req->next;
+    else
+        disk->pending_head = req->next;
+    if (disk->pending_tail == req)
+        disk->pending_tail = prev;
+    req->next = NULL;
+}
+/**
+ * @brief 在op方向(-1为任意)上找离磁盘头最近的请求
+ *        dir > 0: 偏移>=磁盘头中最小的；dir < 0: 偏移<=磁盘头中最大的
+ */
+static struct ddriver_req *sched_nearest(struct ddriver *disk, int op, int dir) {
+    struct ddriver_req *cur, *best = NULL;
+
+    for (cur = disk->pending_head; cur; cur = cur->next) {
+        if (op >= 0 && cur->op != op)
+            continue;
+        if (dir > 0 && cur->offset >= disk->head &&
+            (best == NULL || cur->offset < best->offset))
+            best = cur;
+        if (dir < 0 && cur->offset <= disk->head &&
+            (best == NULL || cur->offset > best->offset))
+            best = cur;
+    }
+    return best;
+}
+/**
+ * @brief 电梯(LOOK)：沿当前方向服务最近的请求，该方向没有请求时掉头
+ */
+static struct ddriver_req *sched_pick_elevator(struct ddriver *disk) {
+    struct ddriver_req *req = sched_nearest(disk, -1, disk->sched_dir);
+
+    if (req == NULL) {
+        disk->sched_dir = -disk->sched_dir;
+        req = sched_nearest(disk, -1, disk->sched_dir);
+    }
+    return req;
+}
+/**
+ * @brief deadline：读优先，写最多被跳过writes_starved次；
+ *        所选方向上最老的请求超时则先服务它，否则按偏移升序循环扫描(C-SCAN)
+ */
+static struct ddriver_req *sched_pick_deadline(struct ddriver *disk) {
+    struct ddriver_req *cur, *oldest[2] = { NULL, NULL }, *req;
+    long expire;
+    int op;
+
+    for (cur = disk->pending_head; cur; cur = cur->next) {  /* 队列按到达顺序，第一个即最老 */
+        if (oldest[cur->op] == NULL)
+            oldest[cur->op] = cur;
+    }
+
+    if (oldest[DDRIVER_OP_READ] && (oldest[DDRIVER_OP_WRITE] == NULL ||
+        disk->sched_starved < (int)disk->sched.writes_starved)) {
+        op = DDRIVER_OP_READ;
+        if (oldest[DDRIVER_OP_WRITE])
+            disk->sched_starved++;
+        expire = disk->sched.read_expire_us;
+    }
+    else {
+        op = DDRIVER_OP_WRITE;
+        disk->sched_starved = 0;
+        expire = disk->sched.write_expire_us;
+    }
+
+    if (dev_time(disk) - oldest[op]->stamp >= expire)
+        return oldest[op];
+
+    req = sched_nearest(disk, op, 1);
+    if (req == NULL) {                                     /* 回绕到最低偏移 */
+        for (cur = disk->pending_head; cur; cur = cur->next) {
+            if (cur->op == op && (req == NULL || cur->offset < req->offset))
+                req = cur;
+        }
+    }
+    return req;
+}
+/**
+ * @brief 按调度策略取出下一个请求，并把与之首尾相接的同向请求合并进来
+ * 
+ * @param batch 输出按偏移排好的请求
+ * @return int 请求个数
+ */
+static int sched_dispatch(struct ddriver *disk, struct ddriver_req **batch) {
+    struct ddriver_req *req, *cur;
+    off_t start, end;
+    size_t total;
+    int nr = 1;
+
+    switch (disk->sched.type)
+    {
+    case DDRIVER_SCHED_ELEVATOR:
+        req = sched_pick_elevator(disk);
+        break;
+    case DDRIVER_SCHED_DEADLINE:
+        req = sched_pick_deadline(disk);
+        break;
+    default:
+        req = disk->pending_head;
+        break;
+    }
+    sched_unlink(disk, req);
+    batch[0] = req;
+
+    if (!sched_req_valid(disk, req))
+        return nr;
+    start = req->offset;
+    end   = req->offset + req->size;
+    total = req->size;
+    while (nr < SCHED_MAX_MERGE) {
+        for (cur = disk->pending_head; cur; cur = cur->next) {
+            if (cur->op == req->op && sched_req_valid(disk, cur) &&
+                total + cur->size <= disk->sched.max_merge &&
+                (cur->offset == end || cur->offset + (off_t)cur->size == start))
+                break;
+        }
+        if (cur == NULL)
+            break;
+        sched_unlink(disk, cur);
+        if (cur->offset == end) {                          /* 后向合并 */
+            batch[nr] = cur;
+            end += cur->size;
+        }
+        else {                                             /* 前向合并 */
+            memmove(&batch[1], &batch[0], nr * sizeof(struct ddriver_req *));
+            batch[0] = cur;
+            start = cur->offset;
+        }
+        total += cur->size;
+        disk->stats.merge_cnt++;
+        nr++;
+    }
+    return nr;
+}
+/**
+ * @brief 设置调度器
+ */
+static int set_sched(struct ddriver *disk, const struct ddriver_sched *sched) {
+    if (sched->type < 0 || sched->type >= DDRIVER_SCHED_MAX)
+        return -EINVAL;
+    pthread_mutex_lock(&disk->lock);
+    disk->sched = *sched;
+    disk->sched_dir = 1;
+    disk->sched_starved = 0;
+    pthread_mutex_unlock(&disk->lock);
+    return 0;
+}
+/**
+ * @brief 设置设备并行度，降低后新请求等到在服务的请求数降下来再开始
+ */
+static int set_parallel(struct ddriver *disk, int parallel) {
+    if (parallel <= 0 || parallel > CONFIG_MAX_PARALLEL)
+        return -EINVAL;
+    pthread_mutex_lock(&disk->lock);
+    disk->parallel = parallel;
+    pthread_cond_broadcast(&disk->svc_cond);
+    pthread_cond_broadcast(&disk->submit_cond);      /* 调高后更多worker可以取请求 */
+    pthread_mutex_unlock(&disk->lock);
+    return 0;
+}
+/**
+ * @brief 设置刷写模式
+ */
+static int set_flush_mode(struct ddriver *disk, int mode) {
+    if (mode < 0 || mode >= DDRIVER_FLUSH_MAX)
+        return -EINVAL;
+    pthread_mutex_lock(&disk->lock);
+    disk->flush_mode = mode;
+    pthread_mutex_unlock(&disk->lock);
+    return 0;
+}
+/**
+ * @brief 设置时钟模式，设备时钟重新计时
+ */
+static int set_clock(struct ddriver *disk, int mode) {
+    if (mode < 0 || mode >= DDRIVER_CLOCK_MAX)
+        return -EINVAL;
+    pthread_mutex_lock(&disk->lock);
+    disk->clock_mode = mode;
+    clock_reset(disk);
+    pthread_mutex_unlock(&disk->lock);
+    return 0;
+}
+/**
+ * @brief 设置设备写缓存，原有的脏状态直接丢弃(数据本来就已在镜像中)
+ */
+static int set_cache(struct ddriver *disk, const struct ddriver_cache *cache) {
+    long nblks = disk->layout_size / disk->iounit_size;
+    long cap = cache->size / disk->iounit_size;
+    unsigned char *dirty = NULL;
+    long *fifo = NULL;
 
-FILE *debugf = NULL;
-/******************************************************************************
-* SECTION: Helper Functions
-*******************************************************************************/
-int check_valid(size_t size) {
-    if (size != CONFIG_BLOCK_SZ){
-        user_alert("io size %ld should align to %d", size, CONFIG_BLOCK_SZ);
-        return -EIO;
+    if (cache->policy < 0 || cache->policy >= DDRIVER_DESTAGE_MAX ||
+        (cache->size && cap == 0) || cap > nblks)
+        return -EINVAL;
+    if (cap) {
+        dirty = (unsigned char *)calloc((nblks + 7) / 8, 1);
+        fifo  = (long *)malloc(cap * sizeof(long));
+        if (dirty == NULL || fifo == NULL) {
+            free(dirty);
+            free(fifo);
+            return -ENOMEM;
+        }
+    }
+    pthread_mutex_lock(&disk->lock);
+    free(disk->cache_dirty);
+    free(disk->cache_fifo);
+    disk->cache            = *cache;
+    disk->cache_dirty      = dirty;
+    disk->cache_fifo       = fifo;
+    disk->cache_cap        = cap;
+    disk->cache_head       = 0;
+    disk->cache_used       = 0;
+    disk->cache_dirty_cnt  = 0;
+    disk->cache_idle_since = disk->clock_mode == DDRIVER_CLOCK_VIRTUAL ? disk->vclock : now_us();
+    pthread_mutex_unlock(&disk->lock);
+    return 0;
+}
+/**
+ * @brief 异步worker：每个worker同时只服务一个（合并后的）请求，worker数即队列深度。
+ *        只有设备有空闲的并行槽时才从调度器取请求，否则先取出的批次可能在svc_enter
+ *        上输给后取出的，磁盘头按worker抢锁的顺序而不是调度顺序移动
+ */
+static void *aio_worker(void *arg) {
+    struct ddriver *disk = arg;
+    int fd = disk->ddriver_fd;
+    struct ddriver_req *batch[SCHED_MAX_MERGE];
+    int i, nr;
+
+    pthread_mutex_lock(&disk->lock);
+    while (1) {
+        while ((disk->pending_head == NULL && !disk->stopping) ||
+               (disk->pending_head != NULL && disk->dispatched >= disk->parallel))
+            pthread_cond_wait(&disk->submit_cond, &disk->lock);
+        if (disk->pending_head == NULL)                /* stopping且已排空 */
+            break;
+
+        nr = sched_dispatch(disk, batch);
+        disk->dispatched++;
+        pthread_mutex_unlock(&disk->lock);
+
+        if (disk->clock_mode == DDRIVER_CLOCK_VIRTUAL) {  /* 从请求提交的模拟时刻开始服务 */
+            *vclock_thread(disk) = 0;
+            for (i = 0; i < nr; i++) {
+                if (*vclock_thread(disk) < batch[i]->stamp)
+                    *vclock_thread(disk) = batch[i]->stamp;
+            }
+        }
+        if (nr == 1)
+            batch[0]->res = do_io(disk, fd, batch[0]->op, batch[0]->buf,
+                                  batch[0]->size, batch[0]->offset, batch[0]->flags);
+        else
+            do_merged_io(disk, fd, batch, nr);
+
+        pthread_mutex_lock(&disk->lock);
+        disk->dispatched--;
+        pthread_cond_broadcast(&disk->submit_cond);
+        for (i = 0; i < nr; i++) {
+            if (disk->clock_mode == DDRIVER_CLOCK_VIRTUAL)  /* 完成后stamp改为完成的模拟时刻 */
+                batch[i]->stamp = *vclock_thread(disk);
+            batch[i]->next = NULL;
+            if (disk->done_tail)
+                disk->done_tail->next = batch[i];
+            else
+                disk->done_head = batch[i];
+            disk->done_tail = batch[i];
+            disk->done_cnt++;
+        }
+        pthread_cond_broadcast(&disk->complete_cond);
+    }
+    pthread_mutex_unlock(&disk->lock);
+    return NULL;
+}
+/**
+ * @brief 启动worker，调用者持有disk->lock
+ */
+static int aio_start(struct ddriver *disk) {
+    int i;
+    for (i = 0; i < disk->qdepth; i++) {
+        if (pthread_create(&disk->workers[i], NULL, aio_worker, disk) != 0) {
+            user_alert("can't create aio worker %d", i);
+            break;
+        }
+    }
+    disk->nworkers = i;
+    return i > 0 ? 0 : -EAGAIN;
+}
+/**
+ * @brief 排空队列并停止所有worker
+ */
+static void aio_stop(struct ddriver *disk) {
+    int i, nworkers;
+
+    pthread_mutex_lock(&disk->lock);
+    nworkers = disk->nworkers;
+    disk->stopping = 1;
+    pthread_cond_broadcast(&disk->submit_cond);
+    pthread_mutex_unlock(&disk->lock);
+
+    for (i = 0; i < nworkers; i++)
+        pthread_join(disk->workers[i], NULL);
+
+    pthread_mutex_lock(&disk->lock);
+    disk->nworkers = 0;
+    disk->stopping = 0;
+    pthread_mutex_unlock(&disk->lock);
+}
+/**
+ * @brief 解析大小，支持K/M/G后缀
+ */
+static off_t parse_size(const char *str) {
+    char *end;
+    off_t size = strtoll(str, &end, 0);
+
+    switch (*end)
+    {
+    case 'g': case 'G': size <<= 30; break;
+    case 'm': case 'M': size <<= 20; break;
+    case 'k': case 'K': size <<= 10; break;
+    default: break;
+    }
+    return size;
+}
+/**
+ * @brief 打开时确定设备几何与延迟模型：IO单位须为512~64K的2的幂，设备大小须为IO单位的整数倍
+ */
+static int config_geometry(struct ddriver *disk) {
+    int i;
+    char *env;
+    off_t disk_sz = CONFIG_DISK_SZ;
+    off_t io_sz   = CONFIG_BLOCK_SZ;
+
+    if ((env = getenv(ENV_IO_SZ)) != NULL)
+        io_sz = parse_size(env);
+    if ((env = getenv(ENV_DISK_SZ)) != NULL)
+        disk_sz = parse_size(env);
+
+    if (io_sz < CONFIG_BLOCK_SZ || io_sz > CONFIG_MAX_BLOCK_SZ || (io_sz & (io_sz - 1))) {
+        user_panic("invalid io size %ld", io_sz);
+        return -EINVAL;
+    }
+    if (disk_sz < io_sz || disk_sz % io_sz != 0) {
+        user_panic("disk size %ld should be multiple of io size %ld", disk_sz, io_sz);
+        return -EINVAL;
+    }
+    disk->iounit_size = io_sz;
+    disk->layout_size = disk_sz;
+
+    if ((env = getenv(ENV_MODEL)) != NULL) {
+        for (i = 0; i < DDRIVER_MODEL_MAX; i++) {
+            if (strcmp(env, model_names[i]) == 0)
+                break;
+        }
+        if (i == DDRIVER_MODEL_MAX) {
+            user_panic("unknown device model %s", env);
+            return -EINVAL;
+        }
+        set_model(disk, &model_presets[i]);
+    }
+
+    if ((env = getenv(ENV_SCHED)) != NULL) {
+        struct ddriver_sched sched = disk->sched;
+        for (i = 0; i < DDRIVER_SCHED_MAX; i++) {
+            if (strcmp(env, sched_names[i]) == 0)
+                break;
+        }
+        if (i == DDRIVER_SCHED_MAX) {
+            user_panic("unknown io scheduler %s", env);
+            return -EINVAL;
+        }
+        sched.type = i;
+        set_sched(disk, &sched);
+    }
+
+    if ((env = getenv(ENV_PARALLEL)) != NULL && set_parallel(disk, atoi(env)) < 0) {
+        user_panic("invalid device parallelism %s", env);
+        return -EINVAL;
+    }
+
+    if ((env = getenv(ENV_FLUSH)) != NULL) {
+        for (i = 0; i < DDRIVER_FLUSH_MAX; i++) {
+            if (strcmp(env, flush_names[i]) == 0)
+                break;
+        }
+        if (i == DDRIVER_FLUSH_MAX) {
+            user_panic("unknown flush mode %s", env);
+            return -EINVAL;
+        }
+        set_flush_mode(disk, i);
+    }
+
+    if ((env = getenv(ENV_CLOCK)) != NULL) {
+        for (i = 0; i < DDRIVER_CLOCK_MAX; i++) {
+            if (strcmp(env, clock_names[i]) == 0)
+                break;
+        }
+        if (i == DDRIVER_CLOCK_MAX) {
+            user_panic("unknown clock mode %s", env);
+            return -EINVAL;
+        }
+        set_clock(disk, i);
+    }
+
+    if ((env = getenv(ENV_CACHE)) != NULL) {
+        struct ddriver_cache cache = { .size         = parse_size(env),
+                                       .policy       = DDRIVER_DESTAGE_LAZY,
+                                       .write_lat_us = CONFIG_CACHE_WRITE_LAT,
+                                       .read_lat_us  = CONFIG_CACHE_READ_LAT,
+                                       .idle_us      = CONFIG_CACHE_IDLE };
+        if (strstr(env, ",idle"))
+            cache.policy = DDRIVER_DESTAGE_IDLE;
+        if (set_cache(disk, &cache) < 0) {
+            user_panic("invalid device cache %s", env);
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+/**
+ * @brief 按句柄查找设备
+ */
+static struct ddriver *dev_get(int fd) {
+    struct ddriver *disk = NULL;
+    int i;
+
+    pthread_mutex_lock(&devs_lock);
+    for (i = 0; i < CONFIG_MAX_DEVS; i++) {
+        if (devs[i] && devs[i]->ddriver_fd == fd) {
+            disk = devs[i];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&devs_lock);
+    return disk;
+}
+/**
+ * @brief 登记设备，同一镜像不能同时打开两次，调用者持有devs_lock
+ */
+static int dev_register(struct ddriver *disk) {
+    int i, slot = -1;
+
+    for (i = 0; i < CONFIG_MAX_DEVS; i++) {
+        if (devs[i] == NULL) {
+            if (slot < 0)
+                slot = i;
+        }
+        else if (devs[i]->st_dev == disk->st_dev && devs[i]->st_ino == disk->st_ino) {
+            return -EBUSY;
+        }
     }
+    if (slot < 0)
+        return -EMFILE;
+    devs[slot] = disk;
+    disk->idx  = slot;
     return 0;
 }
+/**
+ * @brief 释放设备状态
+ */
+static void dev_free(struct ddriver *disk) {
+    if (disk->debugf)
+        fclose(disk->debugf);
+    if (disk->trace)
+        fclose(disk->trace);
+    if (disk->ddriver_fd >= 0)
+        close(disk->ddriver_fd);
+    free(disk->cache_dirty);
+    free(disk->cache_fifo);
+    if (disk->base_fd >= 0)
+        close(disk->base_fd);
+    free(disk->cow_map);
+    free(disk->cow_path);
+    pthread_mutex_destroy(&disk->lock);
+    pthread_mutex_destroy(&disk->trace_lock);
+    pthread_cond_destroy(&disk->submit_cond);
+    pthread_cond_destroy(&disk->complete_cond);
+    pthread_cond_destroy(&disk->svc_cond);
+    free(disk);
+}
+/**
+ * @brief 按DDRIVER_TRACE开启请求记录，写入文件头
+ */
+static int trace_open(struct ddriver *disk, char *path) {
+    struct ddriver_trace_hdr hdr;
+    char *env = getenv(ENV_TRACE);
+    char *trace_path;
 
-int emulate_rotate(int fd, off_t start, off_t end) {
-    int bytes_per_track = disk.layout_size / disk.track_num;
-    int lat_per_track = disk.seek_lat;
-    int distance = abs(end - start) % bytes_per_track; 
-    
-    if (distance == 0) {
+    if (env == NULL || *env == '\0' || strcmp(env, "0") == 0)
         return 0;
+    trace_path = (char *)malloc(strlen(path) + sizeof(DEVICE_TRACE));
+    sprintf(trace_path, "%s" DEVICE_TRACE, path);
+    disk->trace = fopen(trace_path, "w");
+    if (disk->trace == NULL) {
+        user_panic("can't init trace: %s", trace_path);
+        free(trace_path);
+        return -1;
     }
+    free(trace_path);
 
-    usleep(distance * lat_per_track / bytes_per_track * 1000);
+    hdr.magic       = DDRIVER_TRACE_MAGIC;
+    hdr.version     = DDRIVER_TRACE_VERSION;
+    hdr.iounit_size = disk->iounit_size;
+    hdr.rec_size    = sizeof(struct ddriver_trace_rec);
+    hdr.layout_size = disk->layout_size;
+    fwrite(&hdr, sizeof(hdr), 1, disk->trace);
+    disk->trace_start = now_us();
     return 0;
 }
 /******************************************************************************
 * SECTION: Global Function Implementation
 *******************************************************************************/
 /**
- * @brief 打开驱动
+ * @brief 打开驱动，每个镜像是一个独立的设备，有自己的磁盘头、统计、队列和日志
  * 
- * @return int 文件描述符
+ * @param path 镜像路径，不存在则创建；日志写到路径加"_log"
+ * @return int 文件描述符，同时作为设备句柄
  */
 int ddriver_open(char *path) {
-    int fd, ret = 0;
-    char device_path[128] = {0};
-    char log_path[128] = {0};
-    
-    sprintf(device_path, "%s/" DEVICE_NAME, getpwuid(getuid())->pw_dir);
-    sprintf(log_path, "%s/" DEVICE_LOG, getpwuid(getuid())->pw_dir);
-    
-    if (strcmp(device_path, path) != 0) {
-        user_panic("wrong path [%s], should be [%s]", path, device_path);
-        return -1;
+    int ret = 0;
+    char *log_path;
+    struct stat st;
+    struct ddriver *disk;
+
+    disk = (struct ddriver *)malloc(sizeof(struct ddriver));
+    if (disk == NULL)
+        return -ENOMEM;
+    *disk = disk_default;
+    disk->ddriver_fd = -1;
+    pthread_mutex_init(&disk->lock, NULL);
+    pthread_mutex_init(&disk->trace_lock, NULL);
+    pthread_cond_init(&disk->submit_cond, NULL);
+    pthread_cond_init(&disk->complete_cond, NULL);
+    pthread_cond_init(&disk->svc_cond, NULL);
+    clock_reset(disk);
+
+    ret = config_geometry(disk);
+    if (ret < 0) {
+        dev_free(disk);
+        return ret;
     }
 
-    if (access(device_path, F_OK) == 0) {
-        fd = open(device_path, O_RDWR);
+    if (access(path, F_OK) == 0) {
+        disk->ddriver_fd = open(path, O_RDWR);
     }
     else {
-        fd = open(device_path, O_CREAT | O_TRUNC | O_RDWR, 0644);
+        disk->ddriver_fd = open(path, O_CREAT | O_TRUNC | O_RDWR, 0644);
     }
-    if (fd < 0) {
-        user_panic("can't open device: %d", fd);
-        return fd;
+    if (disk->ddriver_fd < 0) {
+        user_panic("can't open device [%s]: %s", path, strerror(errno));
+        ret = -errno;
+        dev_free(disk);
+        return ret;
     }
-    ret = posix_fallocate(fd, 0, CONFIG_DISK_SZ);
-    if (ret < 0) {
-        user_panic("low space");
+    fstat(disk->ddriver_fd, &st);
+    if (st.st_size < disk->layout_size &&               /* 只扩展大小，不预分配，镜像保持稀疏 */
+        ftruncate(disk->ddriver_fd, disk->layout_size) < 0) {
+        user_panic("can't resize device: %s", strerror(errno));
+        ret = -errno;
+        dev_free(disk);
         return ret;
     }
+    disk->st_dev = st.st_dev;
+    disk->st_ino = st.st_ino;
 
-    debugf = fopen(log_path, "w+");
-    if (debugf == NULL) {
+    log_path = (char *)malloc(strlen(path) + sizeof(DEVICE_LOG));
+    sprintf(log_path, "%s" DEVICE_LOG, path);
+    disk->debugf = fopen(log_path, "w+");
+    if (disk->debugf == NULL) {
         user_panic("can't init log: %s", log_path);
+        free(log_path);
+        dev_free(disk);
         return -1;
     }
+    free(log_path);
 
-    return fd;
+    if (trace_open(disk, path) < 0) {
+        dev_free(disk);
+        return -1;
+    }
+
+    disk->cow_path = (char *)malloc(strlen(path) + sizeof(DEVICE_COW));
+    sprintf(disk->cow_path, "%s" DEVICE_COW, path);
+    ret = cow_load(disk);                               /* 之前被克隆过则重新挂上快照 */
+    if (ret < 0) {
+        dev_free(disk);
+        return ret;
+    }
+
+    pthread_mutex_lock(&devs_lock);
+    ret = dev_register(disk);
+    pthread_mutex_unlock(&devs_lock);
+    if (ret < 0) {
+        user_panic("can't register device [%s]: %s", path, strerror(-ret));
+        dev_free(disk);
+        return ret;
+    }
+
+    return disk->ddriver_fd;
 }
 /**
  * @brief 关闭驱动
@@ -168,7 +1965,30 @@ int ddriver_open(char *path) {
  * @return int 
  */
 int ddriver_close(int fd) {
-    return close(fd) && fclose(debugf);
+    struct ddriver *disk = dev_get(fd);
+    int i;
+
+    if (disk == NULL)
+        return -EBADF;
+    aio_stop(disk);
+    if (disk->map) {
+        ddriver_flush_map(fd);
+        munmap(disk->map, disk->layout_size);
+        free(disk->map_dirty);
+        disk->map = NULL;
+        disk->map_dirty = NULL;
+    }
+    cow_save(disk);
+
+    pthread_mutex_lock(&devs_lock);
+    for (i = 0; i < CONFIG_MAX_DEVS; i++) {
+        if (devs[i] == disk)
+            devs[i] = NULL;
+    }
+    pthread_mutex_unlock(&devs_lock);
+
+    dev_free(disk);
+    return 0;
 }
 /**
  * @brief 磁盘头SEEK
@@ -178,24 +1998,39 @@ int ddriver_close(int fd) {
  * @param whence 
  * @return int 
  */
-int ddriver_seek(int fd, off_t offset, int whence){
-    int ret = 0;
-    int cur = 0;
+off_t ddriver_seek(int fd, off_t offset, int whence){
+    struct ddriver *disk = dev_get(fd);
+    off_t ret = 0;
+    long lat;
+    int slot;
 
-    if (!IS_ADDR_ALIGN(offset)) {
-        user_alert("offset %ld must be aligned to block size %d", 
-                      offset, CONFIG_BLOCK_SZ);
-        return -EINVAL;
-    }
+    if (disk == NULL)
+        return -EBADF;
 
-    INC_SEEKCNT(disk);
-    cur = lseek(fd, 0, SEEK_CUR);
-    ret = lseek(fd, offset, whence);
+    ret = check_align(disk, offset);
+    if (ret < 0)
+        return ret;
+
+    pthread_mutex_lock(&disk->lock);
+    switch (whence)
+    {
+    case SEEK_SET: ret = offset; break;
+    case SEEK_CUR: ret = disk->pos + offset; break;
+    case SEEK_END: ret = disk->layout_size + offset; break;
+    default:       ret = -EINVAL; break;
+    }
+    if (ret >= 0)
+        disk->pos = ret;
+    pthread_mutex_unlock(&disk->lock);
     if (ret < 0) {
-        user_panic("seek error: %s", strerror(errno));
+        user_panic("seek error: whence %d offset %ld", whence, offset);
         return ret;
     }
-    emulate_rotate(fd, cur, ret);
+
+    trace_io(disk, DDRIVER_TRACE_SEEK, 0, ret, 0, 0);
+    slot = svc_enter(disk, OP_SEEK, ret, 0, &lat);
+    dev_sleep(disk, lat);
+    svc_exit(disk, slot);
     return ret;
 }
 /**
@@ -207,15 +2042,19 @@ int ddriver_seek(int fd, off_t offset, int whence){
  * @return int 
  */
 int ddriver_write(int fd, char *buf, size_t size){
-    int res = check_valid(size);
+    struct ddriver *disk = dev_get(fd);
+    int res;
+    if (disk == NULL)
+        return -EBADF;
+    res = check_valid(disk, size);
     if(res < 0)
         return res;
         
-    RW_DELAY(disk, write);
-    write(fd, buf, size);
+    res = seq_io(disk, DDRIVER_OP_WRITE, buf, size);
+    if (res < 0)
+        return res;
 
-    INC_WRITECNT(disk);
-    return CONFIG_BLOCK_SZ;
+    return disk->iounit_size;
 }
 /**
  * @brief 
@@ -226,15 +2065,295 @@ int ddriver_write(int fd, char *buf, size_t size){
  * @return int 
  */
 int ddriver_read(int fd, char *buf, size_t size){
-    int res = check_valid(size);
+    struct ddriver *disk = dev_get(fd);
+    int res;
+    if (disk == NULL)
+        return -EBADF;
+    res = check_valid(disk, size);
+    if(res < 0)
+        return res;
+
+    res = seq_io(disk, DDRIVER_OP_READ, buf, size);
+    if (res < 0)
+        return res;
+
+    return disk->iounit_size;
+}
+/**
+ * @brief 连续写入多个IO单位，整个请求只计一次写延迟
+ * 
+ * @param fd 
+ * @param buf 
+ * @param size 必须为IO单位的整数倍
+ * @return int 写入字节数
+ */
+int ddriver_writev(int fd, char *buf, size_t size){
+    struct ddriver *disk = dev_get(fd);
+    int res;
+    if (disk == NULL)
+        return -EBADF;
+    res = check_valid_multi(disk, size);
+    if(res < 0)
+        return res;
+
+    res = seq_io(disk, DDRIVER_OP_WRITE, buf, size);
+    if (res < 0)
+        return res;
+
+    return size;
+}
+/**
+ * @brief 连续读出多个IO单位，整个请求只计一次读延迟
+ * 
+ * @param fd 
+ * @param buf 
+ * @param size 必须为IO单位的整数倍
+ * @return int 读出字节数
+ */
+int ddriver_readv(int fd, char *buf, size_t size){
+    struct ddriver *disk = dev_get(fd);
+    int res;
+    if (disk == NULL)
+        return -EBADF;
+    res = check_valid_multi(disk, size);
     if(res < 0)
         return res;
 
-    RW_DELAY(disk, read);
-    read(fd, buf, size);
+    res = seq_io(disk, DDRIVER_OP_READ, buf, size);
+    if (res < 0)
+        return res;
+
+    return size;
+}
+/**
+ * @brief 指定位置写入，无需单独SEEK，不改变文件偏移
+ * 
+ * @param fd 
+ * @param buf 
+ * @param size 必须为IO单位的整数倍
+ * @param offset 必须与IO单位对齐
+ * @return int 写入字节数
+ */
+int ddriver_pwrite(int fd, char *buf, size_t size, off_t offset){
+    return ddriver_pwrite_flags(fd, buf, size, offset, 0);
+}
+/**
+ * @brief 带标志的定位写
+ * 
+ * @param fd 
+ * @param buf 
+ * @param size 必须为IO单位的整数倍
+ * @param offset 必须与IO单位对齐
+ * @param flags DDRIVER_REQ_FUA写完即落盘，DDRIVER_REQ_PREFLUSH写之前先刷写
+ * @return int 写入字节数
+ */
+int ddriver_pwrite_flags(int fd, char *buf, size_t size, off_t offset, int flags){
+    struct ddriver *disk = dev_get(fd);
+    if (disk == NULL)
+        return -EBADF;
+    trace_io(disk, DDRIVER_TRACE_WRITE, flags, offset, size, 0);
+    return do_io(disk, fd, DDRIVER_OP_WRITE, buf, size, offset, flags);
+}
+/**
+ * @brief 指定位置读出，无需单独SEEK，不改变文件偏移
+ * 
+ * @param fd 
+ * @param buf 
+ * @param size 必须为IO单位的整数倍
+ * @param offset 必须与IO单位对齐
+ * @return int 读出字节数
+ */
+int ddriver_pread(int fd, char *buf, size_t size, off_t offset){
+    struct ddriver *disk = dev_get(fd);
+    if (disk == NULL)
+        return -EBADF;
+    trace_io(disk, DDRIVER_TRACE_READ, 0, offset, size, 0);
+    return do_io(disk, fd, DDRIVER_OP_READ, buf, size, offset, 0);
+}
+/**
+ * @brief 批量提交异步请求，立即返回；请求完成后通过ddriver_getevents收割
+ * 
+ * @param fd 
+ * @param reqs 请求数组，收割前请求及其buf不能释放
+ * @param nr 请求个数
+ * @return int 提交的请求数，小于0失败
+ */
+int ddriver_submit(int fd, struct ddriver_req **reqs, int nr){
+    struct ddriver *disk = dev_get(fd);
+    int i;
+
+    if (disk == NULL)
+        return -EBADF;
+
+    pthread_mutex_lock(&disk->lock);
+    if (disk->nworkers == 0 && aio_start(disk) < 0) {
+        pthread_mutex_unlock(&disk->lock);
+        return -EAGAIN;
+    }
+    for (i = 0; i < nr; i++) {
+        reqs[i]->next  = NULL;
+        reqs[i]->res   = 0;
+        reqs[i]->stamp = disk->clock_mode == DDRIVER_CLOCK_VIRTUAL ? *vclock_thread(disk) 
+                                                                   : dev_time(disk);
+        trace_io(disk, TRACE_OP(reqs[i]->op), reqs[i]->flags | DDRIVER_TRACE_F_ASYNC,
+                 reqs[i]->offset, reqs[i]->size, i);
+        if (disk->pending_tail)
+            disk->pending_tail->next = reqs[i];
+        else
+            disk->pending_head = reqs[i];
+        disk->pending_tail = reqs[i];
+        disk->inflight++;
+    }
+    pthread_cond_broadcast(&disk->submit_cond);
+    pthread_mutex_unlock(&disk->lock);
+    return nr;
+}
+/**
+ * @brief 收割已完成的异步请求
+ * 
+ * @param fd 
+ * @param min_nr 至少等待完成的请求数，0表示只轮询不等待
+ * @param max_nr 最多收割的请求数
+ * @param events 输出已完成的请求，结果见req->res
+ * @return int 收割的请求数
+ */
+int ddriver_getevents(int fd, int min_nr, int max_nr, struct ddriver_req **events){
+    struct ddriver *disk = dev_get(fd);
+    int n = 0;
+    struct ddriver_req *req;
+
+    if (disk == NULL)
+        return -EBADF;
+
+    pthread_mutex_lock(&disk->lock);
+    if (min_nr > disk->inflight)                       /* 不会再有更多完成 */
+        min_nr = disk->inflight;
+    while (disk->done_cnt < min_nr)
+        pthread_cond_wait(&disk->complete_cond, &disk->lock);
+    while (n < max_nr && disk->done_head) {
+        req = disk->done_head;
+        disk->done_head = req->next;
+        if (disk->done_head == NULL)
+            disk->done_tail = NULL;
+        req->next = NULL;
+        if (disk->clock_mode == DDRIVER_CLOCK_VIRTUAL && *vclock_thread(disk) < req->stamp)
+            *vclock_thread(disk) = req->stamp;           /* 收割者等到请求完成的模拟时刻 */
+        events[n++] = req;
+    }
+    disk->done_cnt -= n;
+    disk->inflight -= n;
+    pthread_mutex_unlock(&disk->lock);
+    return n;
+}
+/**
+ * @brief 返回某个IO单位在镜像映射中的地址，文件系统可原地解析，无需拷贝
+ *        映射覆盖整个设备且连续，因此可以访问从blkno开始的多个IO单位
+ *        修改后需ddriver_dirty_block标记，并由ddriver_flush_map写回
+ * 
+ * @param fd 
+ * @param blkno IO单位编号
+ * @return char* 映射地址，失败返回NULL
+ */
+char *ddriver_map_block(int fd, int blkno){
+    struct ddriver *disk = dev_get(fd);
+    long lat;
+    int nblks, slot;
+    void *map;
+
+    if (disk == NULL)
+        return NULL;
+    nblks = disk->layout_size / disk->iounit_size;
+    if (blkno < 0 || blkno >= nblks) {
+        user_alert("map block %d out of range", blkno);
+        return NULL;
+    }
+    if (disk->base_fd >= 0) {                          /* 克隆的内容分散在两个文件，不能整体映射 */
+        user_alert("can't map a clone");
+        return NULL;
+    }
+
+    pthread_mutex_lock(&disk->lock);
+    if (disk->map == NULL) {
+        map = mmap(NULL, disk->layout_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            pthread_mutex_unlock(&disk->lock);
+            user_panic("mmap error: %s", strerror(errno));
+            return NULL;
+        }
+        disk->map       = map;
+        disk->map_dirty = calloc((nblks + 7) / 8, 1);
+    }
+    pthread_mutex_unlock(&disk->lock);
+
+    trace_io(disk, DDRIVER_TRACE_READ, DDRIVER_TRACE_F_MAP, (off_t)blkno * disk->iounit_size,
+             disk->iounit_size, 0);
+    slot = svc_enter(disk, DDRIVER_OP_READ, (off_t)blkno * disk->iounit_size, 
+                     disk->iounit_size, &lat);         /* 按读一个IO单位计延迟 */
+    dev_sleep(disk, lat);
+    svc_exit(disk, slot);
+    return disk->map + (off_t)blkno * disk->iounit_size;
+}
+/**
+ * @brief 标记映射中的IO单位已修改
+ * 
+ * @param fd 
+ * @param blkno IO单位编号
+ * @return int 
+ */
+int ddriver_dirty_block(int fd, int blkno){
+    struct ddriver *disk = dev_get(fd);
+    if (disk == NULL || disk->map == NULL || blkno < 0 || 
+        blkno >= disk->layout_size / disk->iounit_size) {
+        return -EINVAL;
+    }
+    pthread_mutex_lock(&disk->lock);
+    disk->map_dirty[blkno / 8] |= (1 << (blkno % 8));
+    pthread_mutex_unlock(&disk->lock);
+    return 0;
+}
+/**
+ * @brief 将映射中的脏IO单位msync回镜像，每段连续脏区间计一次写延迟
+ * 
+ * @param fd 
+ * @return int 
+ */
+int ddriver_flush_map(int fd){
+    struct ddriver *disk = dev_get(fd);
+    int nblks, start, end, slot, ret = 0;
+    off_t sync_start, sync_end, page = sysconf(_SC_PAGESIZE);
+    long lat;
+
+    if (disk == NULL)
+        return -EBADF;
+
+    if (disk->map == NULL)
+        return 0;
+
+    nblks = disk->layout_size / disk->iounit_size;
+    for (start = 0; start < nblks; start = end) {
+        if (!(disk->map_dirty[start / 8] & (1 << (start % 8)))) {
+            end = start + 1;
+            continue;
+        }
+        pthread_mutex_lock(&disk->lock);
+        for (end = start; end < nblks && (disk->map_dirty[end / 8] & (1 << (end % 8))); end++)
+            disk->map_dirty[end / 8] &= ~(1 << (end % 8));
+        pthread_mutex_unlock(&disk->lock);
 
-    INC_READCNT(disk);
-    return CONFIG_BLOCK_SZ;
+        trace_io(disk, DDRIVER_TRACE_WRITE, DDRIVER_TRACE_F_MAP, (off_t)start * disk->iounit_size,
+                 (size_t)(end - start) * disk->iounit_size, 0);
+        slot = svc_enter(disk, DDRIVER_OP_WRITE, (off_t)start * disk->iounit_size,
+                         (size_t)(end - start) * disk->iounit_size, &lat);
+        dev_sleep(disk, lat);
+        sync_start = (off_t)start * disk->iounit_size / page * page;   /* msync要求页对齐 */
+        sync_end   = (off_t)end * disk->iounit_size;
+        if (msync(disk->map + sync_start, sync_end - sync_start, MS_SYNC) < 0) {
+            user_panic("msync error: %s", strerror(errno));
+            ret = -EIO;
+        }
+        svc_exit(disk, slot);
+    }
+    return ret;
 }
 /**
  * @brief 
@@ -245,32 +2364,143 @@ int ddriver_read(int fd, char *buf, size_t size){
  * @return int 
  */
 int ddriver_ioctl(int fd, unsigned long cmd, void *arg){
+    struct ddriver *disk = dev_get(fd);
     struct ddriver_state state;
+    struct ddriver_stats stats;
+    struct ddriver_discard discard;
+    int qdepth, parallel, mode, busy, size, ret;
+    uint64_t size64;
+    uint32_t stats_sz;
+
+    if (disk == NULL)
+        return -EBADF;
+    if (cmd == IOC_REQ_DEVICE_DISCARD) {
+        memcpy(&discard, arg, sizeof(struct ddriver_discard));
+        trace_io(disk, DDRIVER_TRACE_IOCTL, 0, discard.offset, discard.len, cmd);
+    }
+    else {
+        trace_io(disk, DDRIVER_TRACE_IOCTL, 0, 0, 0, cmd);
+    }
     switch (cmd)
     {
-    case IOC_REQ_DEVICE_SIZE:                         /* Device Size */
-        memcpy(arg, &disk.layout_size, sizeof(int));
+    case IOC_REQ_DEVICE_SIZE:                         /* Device Size，超过int时截断 */
+        size = disk->layout_size > INT_MAX ? INT_MAX : (int)disk->layout_size;
+        memcpy(arg, &size, sizeof(int));
         break;
-    case IOC_REQ_DEVICE_STATE:                        /* Device State */
-        state.read_cnt = disk.read_cnt;
-        state.write_cnt = disk.write_cnt;
-        state.seek_cnt = disk.seek_cnt;
+    case IOC_REQ_DEVICE_SIZE64:                       /* Device Size，64位 */
+        size64 = disk->layout_size;
+        memcpy(arg, &size64, sizeof(uint64_t));
+        break;
+    case IOC_REQ_DEVICE_STATE:                        /* Device State，旧接口，计数饱和于INT_MAX */
+        pthread_mutex_lock(&disk->lock);
+        state.read_cnt = CAP_INT(disk->stats.read_cnt);
+        state.write_cnt = CAP_INT(disk->stats.write_cnt);
+        state.seek_cnt = CAP_INT(disk->stats.seek_cnt);
+        pthread_mutex_unlock(&disk->lock);
         memcpy(arg, &state, sizeof(struct ddriver_state));
         break;
-    case IOC_REQ_DEVICE_RESET:                        /* Reset Device */
-        lseek(fd, 0, SEEK_SET);
-        char buf[4096] = {'\0'};
-        for (size_t i = 0; i < CONFIG_DISK_SZ; i += 4096)
-        {
-            write(fd, buf, 4096);
+    case IOC_REQ_DEVICE_STATS:                        /* 64位统计 */
+    case IOC_REQ_DEVICE_STATS_RESET:                  /* 取快照并清零，便于分阶段统计 */
+        memcpy(&stats_sz, &((struct ddriver_stats *)arg)->size, sizeof(uint32_t));
+        if (stats_sz == 0 || stats_sz > sizeof(struct ddriver_stats))
+            stats_sz = sizeof(struct ddriver_stats);
+        pthread_mutex_lock(&disk->lock);
+        stats = disk->stats;
+        stats.cache_dirty_bytes = (uint64_t)disk->cache_dirty_cnt * disk->iounit_size;
+        if (cmd == IOC_REQ_DEVICE_STATS_RESET) {
+            memset(&disk->stats, 0, sizeof(struct ddriver_stats));
+            clock_reset(disk);                        /* 设备时间也从零计 */
         }
-        lseek(fd, 0, SEEK_SET);
-        disk.read_cnt = 0;
-        disk.write_cnt = 0;
-        disk.seek_cnt = 0;
+        pthread_mutex_unlock(&disk->lock);
+        stats.version = DDRIVER_STATS_VERSION;
+        stats.size    = stats_sz;
+        memcpy(arg, &stats, stats_sz);
+        break;
+    case IOC_REQ_DEVICE_RESET:                        /* Reset Device，整个设备打洞 */
+        ret = dev_discard(disk, 0, disk->layout_size);
+        if (ret < 0)
+            return ret;
+        pthread_mutex_lock(&disk->lock);
+        disk->head = 0;
+        disk->pos  = 0;
+        memset(&disk->stats, 0, sizeof(struct ddriver_stats));
+        pthread_mutex_unlock(&disk->lock);
         break;
+    case IOC_REQ_DEVICE_DISCARD:                      /* 丢弃区间，已在上面读出 */
+        return dev_discard(disk, discard.offset, discard.len);
+    case IOC_REQ_DEVICE_FLUSH:                        /* 刷写屏障 */
+        return dev_flush(disk);
+    case IOC_REQ_DEVICE_FLUSH_MODE:                   /* 设置刷写模式 */
+        memcpy(&mode, arg, sizeof(int));
+        return set_flush_mode(disk, mode);
+    case IOC_REQ_DEVICE_GET_FLUSH_MODE:               /* 查看刷写模式 */
+        pthread_mutex_lock(&disk->lock);
+        memcpy(arg, &disk->flush_mode, sizeof(int));
+        pthread_mutex_unlock(&disk->lock);
+        break;
+    case IOC_REQ_DEVICE_CLOCK:                        /* 设置时钟模式 */
+        memcpy(&mode, arg, sizeof(int));
+        return set_clock(disk, mode);
+    case IOC_REQ_DEVICE_GET_CLOCK:                    /* 查看时钟模式 */
+        pthread_mutex_lock(&disk->lock);
+        memcpy(arg, &disk->clock_mode, sizeof(int));
+        pthread_mutex_unlock(&disk->lock);
+        break;
+    case IOC_REQ_DEVICE_TIME:                         /* 设备时间(us) */
+        pthread_mutex_lock(&disk->lock);
+        size64 = dev_time(disk);
+        pthread_mutex_unlock(&disk->lock);
+        memcpy(arg, &size64, sizeof(uint64_t));
+        break;
+    case IOC_REQ_DEVICE_CACHE:                        /* 设置设备写缓存 */
+        return set_cache(disk, (struct ddriver_cache *)arg);
+    case IOC_REQ_DEVICE_GET_CACHE:                    /* 查看设备写缓存 */
+        pthread_mutex_lock(&disk->lock);
+        memcpy(arg, &disk->cache, sizeof(struct ddriver_cache));
+        pthread_mutex_unlock(&disk->lock);
+        break;
+    case IOC_REQ_DEVICE_SNAPSHOT:                     /* 保存只读快照 */
+        return dev_snapshot(disk, ((struct ddriver_snapshot *)arg)->path);
+    case IOC_REQ_DEVICE_CLONE:                        /* 从快照克隆 */
+        return dev_clone(disk, ((struct ddriver_snapshot *)arg)->path);
     case IOC_REQ_DEVICE_IO_SZ:
-        memcpy(arg, &disk.iounit_size, sizeof(int));
+        memcpy(arg, &disk->iounit_size, sizeof(int));
+        break;
+    case IOC_REQ_DEVICE_MODEL:                        /* 设置延迟模型 */
+        return set_model(disk, (struct ddriver_model *)arg);
+    case IOC_REQ_DEVICE_GET_MODEL:                    /* 查看延迟模型 */
+        pthread_mutex_lock(&disk->lock);
+        memcpy(arg, &disk->model, sizeof(struct ddriver_model));
+        pthread_mutex_unlock(&disk->lock);
+        break;
+    case IOC_REQ_DEVICE_SCHED:                        /* 设置调度器 */
+        return set_sched(disk, (struct ddriver_sched *)arg);
+    case IOC_REQ_DEVICE_GET_SCHED:                    /* 查看调度器 */
+        pthread_mutex_lock(&disk->lock);
+        memcpy(arg, &disk->sched, sizeof(struct ddriver_sched));
+        pthread_mutex_unlock(&disk->lock);
+        break;
+    case IOC_REQ_DEVICE_QDEPTH:                       /* 设置异步队列深度 */
+        memcpy(&qdepth, arg, sizeof(int));
+        if (qdepth <= 0 || qdepth > CONFIG_MAX_QDEPTH)
+            return -EINVAL;
+        pthread_mutex_lock(&disk->lock);
+        busy = disk->inflight;
+        pthread_mutex_unlock(&disk->lock);
+        if (busy)
+            return -EBUSY;
+        aio_stop(disk);                                   /* 下次提交时按新深度启动worker */
+        pthread_mutex_lock(&disk->lock);
+        disk->qdepth = qdepth;
+        pthread_mutex_unlock(&disk->lock);
+        break;
+    case IOC_REQ_DEVICE_PARALLEL:                     /* 设置设备并行度 */
+        memcpy(&parallel, arg, sizeof(int));
+        return set_parallel(disk, parallel);
+    case IOC_REQ_DEVICE_GET_PARALLEL:                 /* 查看设备并行度 */
+        pthread_mutex_lock(&disk->lock);
+        memcpy(arg, &disk->parallel, sizeof(int));
+        pthread_mutex_unlock(&disk->lock);
         break;
     default:
         break;
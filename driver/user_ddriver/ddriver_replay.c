@@ -0,0 +1,275 @@
+/******************************************************************************
+* ddriver_replay: 把DDRIVER_TRACE录下的请求序列重新发往任意设备模型
+*
+* 用法: ddriver_replay [-t] <trace> <image>
+*   -t      按记录中的时间戳发出请求，默认尽快发出
+*   镜像的IO单位和大小取自trace文件头，设备模型、调度器、并行度、刷写模式等
+*   照常取自DDRIVER_MODEL / DDRIVER_SCHED / DDRIVER_PARALLEL / DDRIVER_FLUSH / DDRIVER_CLOCK
+*   DDRIVER_CLOCK=virtual时不睡眠，只报告模拟的设备时间
+*
+* 记录按设备接收的顺序单线程重放；异步请求按原批次提交，遇到同步请求前先收割完
+*******************************************************************************/
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include "include/ddriver.h"
+#include "ddriver_trace.h"
+
+#define REPLAY_MAX_BATCH    256
+
+struct replay
+{
+    int                  fd;
+    int                  timed;
+    long                 start;
+    char                *buf;           /* 同步请求共用的缓冲区 */
+    size_t               buf_sz;
+    struct ddriver_req  *batch[REPLAY_MAX_BATCH];
+    int                  nr_batch;      /* 已收集未提交 */
+    int                  inflight;      /* 已提交未收割 */
+    long                 nr_rec;
+    long                 nr_err;
+};
+
+static long now_us(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000L + tv.tv_usec;
+}
+/**
+ * @brief 保证同步缓冲区至少size字节
+ */
+static int replay_buf(struct replay *rp, size_t size) {
+    char *buf;
+
+    if (size <= rp->buf_sz)
+        return 0;
+    buf = realloc(rp->buf, size);
+    if (buf == NULL)
+        return -ENOMEM;
+    memset(buf + rp->buf_sz, 0, size - rp->buf_sz);
+    rp->buf = buf;
+    rp->buf_sz = size;
+    return 0;
+}
+/**
+ * @brief 提交已收集的异步批次
+ */
+static void replay_submit(struct replay *rp) {
+    int ret;
+
+    if (rp->nr_batch == 0)
+        return;
+    ret = ddriver_submit(rp->fd, rp->batch, rp->nr_batch);
+    if (ret < 0) {
+        fprintf(stderr, "submit: %s\n", strerror(-ret));
+        rp->nr_err += rp->nr_batch;
+        while (rp->nr_batch > 0) {
+            rp->nr_batch--;
+            free(rp->batch[rp->nr_batch]->buf);
+            free(rp->batch[rp->nr_batch]);
+        }
+        return;
+    }
+    rp->inflight += rp->nr_batch;
+    rp->nr_batch = 0;
+}
+/**
+ * @brief 提交并收割所有异步请求
+ */
+static void replay_drain(struct replay *rp) {
+    struct ddriver_req *events[REPLAY_MAX_BATCH];
+    int i, nr;
+
+    replay_submit(rp);
+    while (rp->inflight > 0) {
+        nr = ddriver_getevents(rp->fd, 1, REPLAY_MAX_BATCH, events);
+        if (nr < 0) {
+            fprintf(stderr, "getevents: %s\n", strerror(-nr));
+            rp->nr_err += rp->inflight;
+            rp->inflight = 0;
+            return;
+        }
+        for (i = 0; i < nr; i++) {
+            if (events[i]->res < 0)
+                rp->nr_err++;
+            free(events[i]->buf);
+            free(events[i]);
+        }
+        rp->inflight -= nr;
+    }
+}
+/**
+ * @brief 收集一条异步记录，cmd为0时表示新的一批
+ */
+static int replay_async(struct replay *rp, struct ddriver_trace_rec *rec) {
+    struct ddriver_req *req;
+
+    if (rec->cmd == 0 || rp->nr_batch == REPLAY_MAX_BATCH)
+        replay_submit(rp);
+    req = (struct ddriver_req *)calloc(1, sizeof(struct ddriver_req));
+    if (req == NULL)
+        return -ENOMEM;
+    req->buf = (char *)calloc(1, rec->size);
+    if (req->buf == NULL) {
+        free(req);
+        return -ENOMEM;
+    }
+    req->op     = rec->op == DDRIVER_TRACE_READ ? DDRIVER_OP_READ : DDRIVER_OP_WRITE;
+    req->flags  = rec->flags & 0xff;
+    req->size   = rec->size;
+    req->offset = rec->offset;
+    rp->batch[rp->nr_batch++] = req;
+    return 0;
+}
+/**
+ * @brief 重放一条ioctl，只有影响设备内容或耗时的命令需要重发
+ */
+static int replay_ioctl(struct replay *rp, struct ddriver_trace_rec *rec) {
+    struct ddriver_discard discard;
+
+    switch (rec->cmd)
+    {
+    case IOC_REQ_DEVICE_RESET:
+        return ddriver_ioctl(rp->fd, IOC_REQ_DEVICE_RESET, NULL);
+    case IOC_REQ_DEVICE_DISCARD:
+        discard.offset = rec->offset;
+        discard.len    = rec->size;
+        return ddriver_ioctl(rp->fd, IOC_REQ_DEVICE_DISCARD, &discard);
+    case IOC_REQ_DEVICE_FLUSH:
+        return ddriver_ioctl(rp->fd, IOC_REQ_DEVICE_FLUSH, NULL);
+    default:
+        return 0;
+    }
+}
+/**
+ * @brief 重放一条记录
+ */
+static int replay_one(struct replay *rp, struct ddriver_trace_rec *rec) {
+    long wait;
+    int ret;
+
+    if (rp->timed) {
+        wait = rp->start + (long)rec->ts_us - now_us();
+        if (wait > 0)
+            usleep(wait);
+    }
+    if (rec->flags & DDRIVER_TRACE_F_ASYNC)
+        return replay_async(rp, rec);
+
+    replay_drain(rp);
+    switch (rec->op)
+    {
+    case DDRIVER_TRACE_SEEK:
+        ret = ddriver_seek(rp->fd, rec->offset, SEEK_SET) < 0 ? -EINVAL : 0;
+        break;
+    case DDRIVER_TRACE_READ:
+    case DDRIVER_TRACE_WRITE:
+        ret = replay_buf(rp, rec->size);
+        if (ret < 0)
+            break;
+        if (rec->op == DDRIVER_TRACE_READ)
+            ret = ddriver_pread(rp->fd, rp->buf, rec->size, rec->offset);
+        else
+            ret = ddriver_pwrite_flags(rp->fd, rp->buf, rec->size, rec->offset,
+                                       rec->flags & 0xff);
+        break;
+    case DDRIVER_TRACE_IOCTL:
+        ret = replay_ioctl(rp, rec);
+        break;
+    default:
+        ret = -EINVAL;
+        break;
+    }
+    return ret;
+}
+
+int main(int argc, char *argv[]) {
+    struct ddriver_trace_hdr hdr;
+    struct ddriver_trace_rec rec;
+    struct ddriver_stats stats;
+    struct replay rp;
+    uint64_t dev_us = 0;
+    char env[32];
+    FILE *trace;
+    long elapsed;
+    int opt;
+
+    memset(&rp, 0, sizeof(rp));
+    while ((opt = getopt(argc, argv, "t")) != -1) {
+        if (opt == 't') {
+            rp.timed = 1;
+        }
+        else {
+            fprintf(stderr, "usage: %s [-t] <trace> <image>\n", argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind != 2) {
+        fprintf(stderr, "usage: %s [-t] <trace> <image>\n", argv[0]);
+        return 1;
+    }
+
+    trace = fopen(argv[optind], "r");
+    if (trace == NULL) {
+        fprintf(stderr, "can't open trace [%s]: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+    if (fread(&hdr, sizeof(hdr), 1, trace) != 1 ||
+        hdr.magic != DDRIVER_TRACE_MAGIC || hdr.version != DDRIVER_TRACE_VERSION ||
+        hdr.rec_size != sizeof(struct ddriver_trace_rec)) {
+        fprintf(stderr, "bad trace header [%s]\n", argv[optind]);
+        fclose(trace);
+        return 1;
+    }
+
+    /* 按录制时的几何参数打开设备，重放本身不再被记录 */
+    snprintf(env, sizeof(env), "%u", hdr.iounit_size);
+    setenv("DDRIVER_IO_SZ", env, 1);
+    snprintf(env, sizeof(env), "%llu", (unsigned long long)hdr.layout_size);
+    setenv("DDRIVER_DISK_SZ", env, 1);
+    unsetenv("DDRIVER_TRACE");
+    rp.fd = ddriver_open(argv[optind + 1]);
+    if (rp.fd < 0) {
+        fprintf(stderr, "can't open device [%s]: %s\n", argv[optind + 1], strerror(-rp.fd));
+        fclose(trace);
+        return 1;
+    }
+
+    rp.start = now_us();
+    while (fread(&rec, sizeof(rec), 1, trace) == 1) {
+        if (replay_one(&rp, &rec) < 0)
+            rp.nr_err++;
+        rp.nr_rec++;
+    }
+    replay_drain(&rp);
+    elapsed = now_us() - rp.start;
+
+    memset(&stats, 0, sizeof(stats));
+    stats.size = sizeof(stats);
+    ddriver_ioctl(rp.fd, IOC_REQ_DEVICE_STATS, &stats);
+    ddriver_ioctl(rp.fd, IOC_REQ_DEVICE_TIME, &dev_us);
+    printf("records:  %ld (%ld failed)\n", rp.nr_rec, rp.nr_err);
+    printf("elapsed:  %ld us\n", elapsed);
+    printf("read:     %llu ops, %llu bytes\n",
+           (unsigned long long)stats.read_cnt, (unsigned long long)stats.read_bytes);
+    printf("write:    %llu ops, %llu bytes\n",
+           (unsigned long long)stats.write_cnt, (unsigned long long)stats.write_bytes);
+    printf("seek:     %llu ops, %llu bytes\n",
+           (unsigned long long)stats.seek_cnt, (unsigned long long)stats.seek_dist);
+    if (stats.cache_writes || stats.cache_read_hits || stats.cache_read_misses)
+        printf("cache:    %llu writes, %llu/%llu read hits, %llu destages, %llu us stalled\n",
+               (unsigned long long)stats.cache_writes, (unsigned long long)stats.cache_read_hits,
+               (unsigned long long)(stats.cache_read_hits + stats.cache_read_misses),
+               (unsigned long long)stats.destage_cnt, (unsigned long long)stats.destage_stall_us);
+    printf("device:   %llu us simulated, %llu us device time\n", 
+           (unsigned long long)stats.sleep_us, (unsigned long long)dev_us);
+
+    ddriver_close(rp.fd);
+    free(rp.buf);
+    fclose(trace);
+    return rp.nr_err ? 2 : 0;
+}
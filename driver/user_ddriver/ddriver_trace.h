@@ -0,0 +1,45 @@
+#ifndef _DDRIVER_TRACE_H_
+#define _DDRIVER_TRACE_H_
+
+#include <stdint.h>
+/******************************************************************************
+* SECTION: IO trace format
+* 文件头 + 定长记录，按设备接收请求的顺序写入，小端
+*******************************************************************************/
+#define DDRIVER_TRACE_MAGIC     0x54524444  /* "DDRT" */
+#define DDRIVER_TRACE_VERSION   1
+
+enum ddriver_trace_op
+{
+    DDRIVER_TRACE_SEEK,         /* offset: 移动到的位置 */
+    DDRIVER_TRACE_READ,
+    DDRIVER_TRACE_WRITE,
+    DDRIVER_TRACE_IOCTL,        /* cmd: ioctl命令；DISCARD时offset/size为区间 */
+};
+
+/* flags低8位为请求的DDRIVER_REQ_*标志 */
+#define DDRIVER_TRACE_F_ASYNC   (1 << 8)    /* 经ddriver_submit提交，cmd为在本批中的序号 */
+#define DDRIVER_TRACE_F_MAP     (1 << 9)    /* map_block / flush_map */
+
+struct ddriver_trace_hdr
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t iounit_size;
+    uint32_t rec_size;          /* sizeof(struct ddriver_trace_rec) */
+    uint64_t layout_size;
+};
+
+struct ddriver_trace_rec
+{
+    uint64_t ts_us;             /* 距打开设备的时间 */
+    uint64_t offset;
+    uint64_t size;
+    uint32_t tid;               /* 发起请求的线程 */
+    uint16_t op;                /* enum ddriver_trace_op */
+    uint16_t flags;
+    uint32_t cmd;
+    uint32_t reserved;
+};
+
+#endif
@@ -2,6 +2,7 @@
 #define _DDRIVER_CTL_H_
 
 #include <sys/ioctl.h>   
+#include <stdint.h>
 /******************************************************************************
 * SECTION: IO ctl protocol definitions
 *******************************************************************************/
@@ -13,9 +14,158 @@ struct ddriver_state
     int seek_cnt;
 };
 
+#define DDRIVER_STATS_VERSION   4
+#define DDRIVER_HIST_BUCKETS    32  /* log2分桶：第i桶为[2^i, 2^(i+1))，第0桶含0 */
+
+struct ddriver_stats
+{
+    uint32_t version;           /* 驱动填入DDRIVER_STATS_VERSION */
+    uint32_t size;              /* 调用者填入sizeof，驱动最多拷贝这么多字节，0为完整结构 */
+    uint64_t read_cnt;
+    uint64_t write_cnt;
+    uint64_t seek_cnt;
+    uint64_t merge_cnt;         /* 被调度器合并进其他请求的请求数 */
+    uint64_t read_bytes;
+    uint64_t write_bytes;
+    uint64_t seek_dist;         /* 磁盘头累计移动距离(字节) */
+    uint64_t sleep_us;          /* 实际睡眠付出的延迟 */
+    uint64_t read_lat_us;       /* 读请求累计模拟延迟 */
+    uint64_t write_lat_us;      /* 写请求累计模拟延迟 */
+    uint64_t qd_samples;        /* 队列深度采样数，每个请求采样一次 */
+    uint64_t qd_sum;            /* 采样时设备上同时服务的请求数之和 */
+    uint64_t qd_max;
+    uint64_t read_lat_hist[DDRIVER_HIST_BUCKETS];   /* us */
+    uint64_t write_lat_hist[DDRIVER_HIST_BUCKETS];  /* us */
+    uint64_t seek_dist_hist[DDRIVER_HIST_BUCKETS];  /* IO单位 */
+    uint64_t qd_hist[DDRIVER_HIST_BUCKETS];
+    /* version 2 */
+    uint64_t discard_cnt;
+    uint64_t discard_bytes;
+    /* version 3 */
+    uint64_t flush_cnt;
+    uint64_t fua_cnt;           /* 带FUA的写请求数 */
+    uint64_t flush_us;          /* 刷写与FUA落盘的累计耗时 */
+    /* version 4 */
+    uint64_t cache_read_hits;   /* 读请求全部命中设备缓存 */
+    uint64_t cache_read_misses;
+    uint64_t cache_writes;      /* 被设备缓存吸收的写请求数 */
+    uint64_t destage_cnt;       /* 缓存写回介质的次数，相邻的IO单位合并为一次 */
+    uint64_t destage_bytes;
+    uint64_t destage_stall_us;  /* 请求等待destage的设备时间(缓存满、刷写、FUA) */
+    uint64_t cache_dirty_bytes; /* 取统计时缓存中的脏数据量 */
+};
+
+struct ddriver_discard
+{
+    uint64_t offset;            /* 与IO单位对齐 */
+    uint64_t len;               /* IO单位的整数倍 */
+};
+
+enum ddriver_model_type
+{
+    DDRIVER_MODEL_LEGACY,       /* 固定读2ms/写1ms + 按磁道距离的旋转延迟 */
+    DDRIVER_MODEL_HDD,          /* seek曲线 + 旋转延迟 + 带宽 */
+    DDRIVER_MODEL_SSD,          /* 按页延迟 + 内部通道并行 */
+    DDRIVER_MODEL_NVME,         /* 同SSD，延迟随队列深度扩展 */
+    DDRIVER_MODEL_NONE,         /* 无延迟，仅受带宽上限约束 */
+    DDRIVER_MODEL_MAX
+};
+
+struct ddriver_model
+{
+    int      type;              /* enum ddriver_model_type */
+    uint32_t read_lat_us;       /* HDD: 命令开销; SSD/NVMe: 每页读延迟 */
+    uint32_t write_lat_us;      /* HDD: 命令开销; SSD/NVMe: 每页写延迟 */
+    uint32_t seek_min_us;       /* HDD: 相邻磁道seek */
+    uint32_t seek_max_us;       /* HDD: 全行程seek */
+    uint32_t rpm;               /* HDD: 转速 */
+    uint32_t page_size;         /* SSD/NVMe: 页大小 */
+    uint32_t channels;          /* SSD/NVMe: 内部并行通道数 */
+    uint32_t qd_scale;          /* NVMe: 超过该队列深度后延迟线性增长 */
+    uint64_t bandwidth;         /* 带宽上限(B/s)，0为不限 */
+    uint32_t flush_lat_us;      /* 刷写模式为emulate时一次刷写的延迟 */
+};
+
+enum ddriver_flush_mode
+{
+    DDRIVER_FLUSH_NONE,         /* 刷写为空操作 */
+    DDRIVER_FLUSH_EMULATE,      /* 只付出模型的刷写延迟，不真正落盘 */
+    DDRIVER_FLUSH_FDATASYNC,    /* fdatasync镜像文件 */
+    DDRIVER_FLUSH_FSYNC,        /* fsync镜像文件 */
+    DDRIVER_FLUSH_MAX
+};
+
+enum ddriver_destage_policy
+{
+    DDRIVER_DESTAGE_LAZY,       /* 只在缓存满、刷写屏障和FUA时写回 */
+    DDRIVER_DESTAGE_IDLE,       /* 另外利用设备空闲时间在后台写回 */
+    DDRIVER_DESTAGE_MAX
+};
+
+struct ddriver_cache
+{
+    uint64_t size;              /* 缓存大小(B)，0为关闭 */
+    int      policy;            /* enum ddriver_destage_policy */
+    uint32_t write_lat_us;      /* 写入缓存的延迟 */
+    uint32_t read_lat_us;       /* 读命中缓存的延迟 */
+    uint32_t idle_us;           /* idle: 设备空闲超过该时间才开始后台写回 */
+};
+
+#define DDRIVER_PATH_MAX        256
+
+struct ddriver_snapshot
+{
+    char     path[DDRIVER_PATH_MAX];    /* 快照镜像的路径，以'\0'结尾 */
+};
+
+enum ddriver_clock_mode
+{
+    DDRIVER_CLOCK_REAL,         /* 按延迟真正睡眠 */
+    DDRIVER_CLOCK_VIRTUAL,      /* 只推进模拟的设备时钟，不睡眠 */
+    DDRIVER_CLOCK_MAX
+};
+
+enum ddriver_sched_type
+{
+    DDRIVER_SCHED_NOOP,         /* 按到达顺序服务，仅合并相邻请求 */
+    DDRIVER_SCHED_ELEVATOR,     /* 电梯(LOOK)：沿磁盘头方向按偏移服务 */
+    DDRIVER_SCHED_DEADLINE,     /* 按偏移服务，读优先，请求超时先服务 */
+    DDRIVER_SCHED_MAX
+};
+
+struct ddriver_sched
+{
+    int      type;              /* enum ddriver_sched_type */
+    uint32_t read_expire_us;    /* deadline: 读请求超时 */
+    uint32_t write_expire_us;   /* deadline: 写请求超时 */
+    uint32_t writes_starved;    /* deadline: 读最多连续优先于写的次数 */
+    uint32_t max_merge;         /* 合并后请求的最大字节数，0为不合并 */
+};
+
 #define IOC_REQ_DEVICE_SIZE     _IOR(IOC_MAGIC, 0, int)
 #define IOC_REQ_DEVICE_STATE    _IOR(IOC_MAGIC, 1, struct ddriver_state)
 #define IOC_REQ_DEVICE_RESET    _IO(IOC_MAGIC, 2)
 #define IOC_REQ_DEVICE_IO_SZ    _IOR(IOC_MAGIC, 3, int)
+#define IOC_REQ_DEVICE_QDEPTH   _IOW(IOC_MAGIC, 4, int)
+#define IOC_REQ_DEVICE_SIZE64   _IOR(IOC_MAGIC, 5, uint64_t)
+#define IOC_REQ_DEVICE_MODEL    _IOW(IOC_MAGIC, 6, struct ddriver_model)
+#define IOC_REQ_DEVICE_GET_MODEL _IOR(IOC_MAGIC, 7, struct ddriver_model)
+#define IOC_REQ_DEVICE_SCHED    _IOW(IOC_MAGIC, 8, struct ddriver_sched)
+#define IOC_REQ_DEVICE_GET_SCHED _IOR(IOC_MAGIC, 9, struct ddriver_sched)
+#define IOC_REQ_DEVICE_STATS    _IOR(IOC_MAGIC, 10, struct ddriver_stats)
+#define IOC_REQ_DEVICE_STATS_RESET _IOR(IOC_MAGIC, 11, struct ddriver_stats)
+#define IOC_REQ_DEVICE_PARALLEL _IOW(IOC_MAGIC, 12, int)
+#define IOC_REQ_DEVICE_GET_PARALLEL _IOR(IOC_MAGIC, 13, int)
+#define IOC_REQ_DEVICE_DISCARD  _IOW(IOC_MAGIC, 14, struct ddriver_discard)
+#define IOC_REQ_DEVICE_FLUSH    _IO(IOC_MAGIC, 15)
+#define IOC_REQ_DEVICE_FLUSH_MODE _IOW(IOC_MAGIC, 16, int)
+#define IOC_REQ_DEVICE_GET_FLUSH_MODE _IOR(IOC_MAGIC, 17, int)
+#define IOC_REQ_DEVICE_CLOCK    _IOW(IOC_MAGIC, 18, int)
+#define IOC_REQ_DEVICE_GET_CLOCK _IOR(IOC_MAGIC, 19, int)
+#define IOC_REQ_DEVICE_TIME     _IOR(IOC_MAGIC, 20, uint64_t)
+#define IOC_REQ_DEVICE_CACHE    _IOW(IOC_MAGIC, 21, struct ddriver_cache)
+#define IOC_REQ_DEVICE_GET_CACHE _IOR(IOC_MAGIC, 22, struct ddriver_cache)
+#define IOC_REQ_DEVICE_SNAPSHOT _IOW(IOC_MAGIC, 23, struct ddriver_snapshot)
+#define IOC_REQ_DEVICE_CLONE    _IOW(IOC_MAGIC, 24, struct ddriver_snapshot)
 
 #endif
\ No newline at end of file
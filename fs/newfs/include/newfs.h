@@ -11,6 +11,7 @@
 #include <stddef.h>
 #include "ddriver.h"
 #include "errno.h"
+#include <pthread.h>
 #include "types.h"
 
 #define NEWFS_MAGIC                  /* TODO: Define by yourself */
@@ -48,14 +49,62 @@ int 			   newfs_driver_read(int, uint8_t *, int);
 struct newfs_inode *newfs_alloc_inode(struct newfs_dentry *, boolean);
 int 			   newfs_sync_inode(struct newfs_inode *);
 int 			   newfs_driver_write(int, uint8_t *, int);
+int 			   newfs_driver_write_async(int, uint8_t *, int, struct newfs_inode *);
+int 			   newfs_driver_drain();
+int 			   newfs_driver_discard(int, int);
 struct newfs_inode *newfs_read_inode(struct newfs_dentry *, int);
 int 			   newfs_alloc_dentry(struct newfs_inode *, struct newfs_dentry *);
 int 			   newfs_umount();
+int 			   newfs_sync_fs();
 struct newfs_dentry *newfs_lookup(const char *, boolean *, boolean *);
 int 		   	   newfs_calc_lvl(const char *);
 char* 			   newfs_get_fname(const char* );
 struct newfs_dentry *newfs_get_dentry(struct newfs_inode *, int);
 int 			   newfs_drop_inode(struct newfs_inode *);
 int 			   newfs_drop_dentry(struct newfs_inode *, struct newfs_dentry *);
+uint8_t* 		   newfs_file_block(struct newfs_inode *, int, boolean);
+void 			   newfs_dirty_inode(struct newfs_inode *);
+int 			   newfs_dirty_blk(struct newfs_inode *, int, boolean);
+void 			   newfs_dirty_data(struct newfs_inode *, int, int);
+void 			   newfs_dirty_dentrys(struct newfs_inode *, int);
+
+/******************************************************************************
+* SECTION: newfs_cache.c
+*******************************************************************************/
+int 			   newfs_cache_init(int);
+void 			   newfs_cache_destroy();
+uint8_t* 		   newfs_cache_get(int, boolean);
+uint8_t* 		   newfs_cache_lookup(int);
+int 			   newfs_cache_prefetch(int, int);
+void 			   newfs_cache_dirty(uint8_t *);
+void 			   newfs_cache_write_failed(char *);
+void 			   newfs_cache_invalidate(int, int);
+int 			   newfs_cache_flush();
+
+/******************************************************************************
+* SECTION: newfs_bmap.c
+*******************************************************************************/
+void 			   newfs_bmap_init();
+uint32_t 		   newfs_alloc_data_blk();
+void 			   newfs_free_data_blk(uint32_t);
+uint32_t 		   newfs_bmap(struct newfs_inode *, int, boolean);
+int 			   newfs_bmap_reserve(struct newfs_inode *, int, boolean);
+int 			   newfs_bmap_alloc(struct newfs_inode *);
+void 			   newfs_free_blocks(struct newfs_inode *);
+int 			   newfs_inode_grow(struct newfs_inode *, int);
+
+/******************************************************************************
+* SECTION: newfs_itable.c
+*******************************************************************************/
+int 			   newfs_itable_read(int, struct newfs_inode_d *);
+int 			   newfs_itable_write(struct newfs_inode_d *);
+int 			   newfs_itable_readahead(struct newfs_inode *);
+
+/******************************************************************************
+* SECTION: newfs_flush.c
+*******************************************************************************/
+int 			   newfs_flusher_start(int, int);
+void 			   newfs_flusher_stop();
+void 			   newfs_flusher_note(int);
 
 #endif  /* _newfs_H_ */
\ No newline at end of file
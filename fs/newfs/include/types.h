@@ -33,10 +33,16 @@ typedef enum newfs_file_type {
 #define NEWFS_ERROR_INVAL         EINVAL  /* Invalid Args */
 
 #define MAX_NAME_LEN              64   
-#define NEWFS_DATA_PER_FILE       6     /*一个文件有6块*/
+#define NEWFS_DATA_PER_FILE       6     /*inode中的直接块数，之后是一次和二次间接块*/
 #define NEWFS_INODE_PER_FILE      128   /*一个inode节点占128字节*/
-
-#define NEWFS_MAGIC_NUM           0x52415453  
+#define NEWFS_AIO_BATCH           16    /*一次最多收割的异步请求数*/
+#define NEWFS_AIO_PLUG            64    /*攒够这么多异步写再一起提交，便于驱动调度器排序合并*/
+#define NEWFS_CACHE_BLKS          256   /*块缓存默认容量（块），可用--cache_blks=指定*/
+#define NEWFS_PREFETCH_BLKS       32    /*预读一次设备读的最大块数，即预读缓冲区大小*/
+#define NEWFS_FLUSH_MS            5000  /*后台刷写周期（毫秒），可用--flush_ms=指定，负数关闭后台刷写*/
+#define NEWFS_DIRTY_RATIO         50    /*脏块数达到缓存容量的百分比时提前刷写，可用--dirty_ratio=指定*/
+
+#define NEWFS_MAGIC_NUM           0x52415454  /*布局变化时加一：间接块、数据块0保留；旧镜像会被重新格式化*/
 #define NEWFS_SUPER_OFS           0
 #define NEWFS_ROOT_INO            2
 
@@ -61,7 +67,13 @@ typedef enum newfs_file_type {
 #define NEWFS_IS_SYM_LINK(pinode)         (pinode->dentry->ftype == NEWFS_SYM_LINK)
 // 获取偏移量
 #define NEWFS_INO_OFS(ino)                (super.inode_offset + ino * NEWFS_INODE_PER_FILE)
+#define NEWFS_INO_BLK(ino)                (NEWFS_INO_OFS(ino) / NEWFS_BLK_SZ())   /*inode所在的inode表块号*/
 #define NEWFS_DATA_OFS(ino)               (super.data_offset + NEWFS_BLKS_SZ(ino))
+#define NEWFS_DATA_BLK(bno)               (NEWFS_DATA_OFS(bno) / NEWFS_BLK_SZ())  /*数据块在块缓存中的块号*/
+#define NEWFS_PTRS_PER_BLK()              ((int)(NEWFS_BLK_SZ() / sizeof(uint32_t)))  /*一个间接块中的块号数*/
+#define NEWFS_MAX_FILE_BLKS()             (NEWFS_DATA_PER_FILE + NEWFS_PTRS_PER_BLK() + \
+                                           NEWFS_PTRS_PER_BLK() * NEWFS_PTRS_PER_BLK())
+#define NEWFS_DENTRY_PER_BLK()            ((NEWFS_BLK_SZ() - 1) / sizeof(struct newfs_dentry_d)) /*目录项不跨块*/
 /******************************************************************************
 * SECTION: FS Specific Structure - In memory structure
 *******************************************************************************/
@@ -71,6 +83,37 @@ struct newfs_super;
 
 struct custom_options {
 	const char*        device;
+	int                cache_blks;      /*块缓存容量（块），0为默认值*/
+	int                flush_ms;        /*后台刷写周期（毫秒），0为默认值，负数关闭*/
+	int                dirty_ratio;     /*提前刷写的脏块比例（百分比），0为默认值*/
+};
+
+/*块缓存中的一个块*/
+struct newfs_buf {
+    int                blkno;                         /* 块号，-1表示空闲 */
+    boolean            dirty;                         /* 修改后尚未写回 */
+    uint8_t*           data;                          /* 一个块的内容 */
+    struct newfs_buf*  hnext;                         /* 哈希链 */
+    struct newfs_buf*  prev;                          /* LRU链表，表头最近使用 */
+    struct newfs_buf*  next;
+};
+
+/*按块号索引的块缓存，LRU淘汰*/
+struct newfs_cache {
+    int                nblks;           /*容量（块）*/
+    struct newfs_buf*  bufs;
+    uint8_t*           arena;           /*所有块的内容，连续分配*/
+    uint8_t*           ra_buf;          /*预读缓冲区，NEWFS_PREFETCH_BLKS块，挂载时分配一次*/
+    struct newfs_buf** hash;
+    int                hash_mask;       /*哈希桶数-1，桶数为2的幂*/
+    struct newfs_buf*  lru_head;
+    struct newfs_buf*  lru_tail;
+    int                dirty_cnt;
+    unsigned long      hits;
+    unsigned long      misses;
+    unsigned long      evictions;
+    unsigned long      writebacks;      /*写回设备的块数*/
+    unsigned long      prefetched;      /*预读装入的块数*/
 };
 
 struct newfs_super {
@@ -78,7 +121,7 @@ struct newfs_super {
     /* TODO: Define yourself */
     
     uint32_t           sz_io;   /*单次io大小*/
-    uint32_t           sz_disk; /*磁盘大小*/
+    uint64_t           sz_disk; /*磁盘大小*/
     uint32_t           sz_usage;
     
     uint32_t           max_ino;         
@@ -90,12 +133,31 @@ struct newfs_super {
     uint8_t*           map_data;        /*数据块的位图*/
     uint32_t           map_data_blks;  /*数据块位图所占的数据块*/
     uint32_t           map_data_offset;/*数据块位图的起始地址*/
+    boolean            is_map_in_place; /*位图是否直接映射在设备镜像上*/
+    boolean            is_map_dirty;    /*位图在上次写回后有修改*/
+    int                free_data_blks;  /*空闲数据块数*/
+    int                resv_data_blks;  /*已写入内存、刷写时才分配的数据块数*/
 
     uint32_t           inode_offset;    /*索引节点起始地址*/   
 
     uint32_t           data_offset; /*数据块的起始地址*/
 
     boolean            is_mounted;  /*是否已装载*/
+    int                aio_inflight; /*在飞的异步写请求数*/
+    struct ddriver_req* aio_plug[NEWFS_AIO_PLUG]; /*尚未提交的异步写*/
+    int                aio_plugged;  /*aio_plug中的请求数*/
+    struct newfs_inode* wb_inodes;   /*数据块已提交异步写的文件，写全部完成后才清除脏标记*/
+    struct newfs_cache cache;        /*块缓存，所有元数据和数据读写都经过它*/
+
+    pthread_mutex_t    lock;         /*FUSE操作与后台刷写互斥*/
+    pthread_cond_t     flusher_cond; /*唤醒刷写线程*/
+    pthread_t          flusher;      /*后台刷写线程*/
+    boolean            flusher_on;   /*刷写线程是否在运行*/
+    boolean            flusher_stop; /*通知刷写线程退出*/
+    int                flush_ms;     /*刷写周期（毫秒）*/
+    int                dirty_ratio;  /*脏块比例（百分比）*/
+    int                dirty_blks;   /*上次刷写以来修改过的块数（估计值）*/
+    unsigned long      flushes;      /*后台刷写次数*/
 
     struct newfs_dentry* root_dentry; /*根目录*/
 
@@ -110,8 +172,18 @@ struct newfs_inode {
     uint32_t           dir_cnt;
     struct newfs_dentry* dentry;                        /* 指向该inode的dentry */
     struct newfs_dentry* dentrys;                       /* 所有目录项 */
-    uint8_t*           data;                            /*默认一个文件数据*/
-    uint32_t           block_pointer[6];                          /*数据块指针*/
+    uint8_t**          data;                            /*文件数据，按文件内块号索引，每块一个缓冲区，首次读写该块时才分配并读入*/
+    uint8_t*           dirty;                           /* 需要写回的数据块或目录块，按文件内块号索引 */
+    int                blks_cap;                        /* data和dirty数组的长度 */
+    uint32_t           block_pointer[NEWFS_DATA_PER_FILE];   /*直接块指针，0表示未分配*/
+    uint32_t           ind_pointer;                     /*一次间接块*/
+    uint32_t           dind_pointer;                    /*二次间接块*/
+    boolean            is_dirty;                        /* inode本身需要写回 */
+    boolean            has_dirty_blks;                  /* dirty中有需要写回的块 */
+    int                resv_blks;                       /* 已预留、刷写时才分配的数据块和间接块数 */
+    boolean            has_dirty_child;                 /* 子树中有需要写回的inode */
+    struct newfs_inode* wb_next;                        /* super.wb_inodes链 */
+    boolean            wb_failed;                       /* 本次刷写中有数据块写失败 */
 };
 
 struct newfs_dentry {
@@ -161,7 +233,9 @@ struct newfs_inode_d
     char               target_path[MAX_NAME_LEN];/* store traget path when it is a symlink */
     int                dir_cnt;
     NEWFS_FILE_TYPE    ftype;   
-    uint32_t           block_pointer[6];            /*默认一个文件大小最多为6块*/
+    uint32_t           block_pointer[NEWFS_DATA_PER_FILE]; /*直接块*/
+    uint32_t           ind_pointer;                 /*一次间接块*/
+    uint32_t           dind_pointer;                /*二次间接块*/
 };  
 
 struct newfs_dentry_d
@@ -10,6 +10,9 @@
 *******************************************************************************/
 static const struct fuse_opt option_spec[] = {		/* 用于FUSE文件系统解析参数 */
 	OPTION("--device=%s", device),
+	OPTION("--cache_blks=%d", cache_blks),
+	OPTION("--flush_ms=%d", flush_ms),
+	OPTION("--dirty_ratio=%d", dirty_ratio),
 	FUSE_OPT_END
 };
 
@@ -53,6 +56,12 @@ void* newfs_init(struct fuse_conn_info * conn_info) {
 		fuse_exit(fuse_get_context()->fuse);
 		return NULL;
 	}
+	if (newfs_flusher_start(newfs_options.flush_ms, newfs_options.dirty_ratio) != NEWFS_ERROR_NONE)
+	{
+		newfs_umount();
+		fuse_exit(fuse_get_context()->fuse);
+		return NULL;
+	}
 	return NULL;
 
 	/* 下面是一个控制设备的示例 */
@@ -70,6 +79,7 @@ void* newfs_init(struct fuse_conn_info * conn_info) {
 void newfs_destroy(void* p) {
 	/* TODO: 在这里进行卸载 */
 	
+	newfs_flusher_stop();							/* 先停后台刷写，剩余修改由卸载写回 */
 	if (newfs_umount() != NEWFS_ERROR_NONE) {
 		fuse_exit(fuse_get_context()->fuse);
 		return;
@@ -85,7 +95,7 @@ void newfs_destroy(void* p) {
  * @param mode 创建模式（只读？只写？），可忽略
  * @return int 0成功，否则失败
  */
-int newfs_mkdir(const char* path, mode_t mode) {
+static int newfs_do_mkdir(const char* path, mode_t mode) {
 	/* TODO: 解析路径，创建目录 */
 	(void)mode;
 	boolean is_find, is_root;
@@ -93,6 +103,9 @@ int newfs_mkdir(const char* path, mode_t mode) {
 	struct newfs_dentry* last_dentry = newfs_lookup(path, &is_find, &is_root);
 	struct newfs_dentry* dentry;
 	struct newfs_inode*  inode;
+	if (last_dentry == NULL) {							/* 路径上的inode读不出来 */
+		return -NEWFS_ERROR_IO;
+	}
 
 	// 文件名已存在
 	if (is_find) {
@@ -108,6 +121,7 @@ int newfs_mkdir(const char* path, mode_t mode) {
 	dentry->parent = last_dentry;			
 	inode  = newfs_alloc_inode(dentry, FALSE);		// 为目录项分配指向的inode
 	newfs_alloc_dentry(last_dentry->inode, dentry);	// 将dentry添加到last_dentry的inode中
+	newfs_dirty_dentrys(last_dentry->inode, last_dentry->inode->dir_cnt - 1);	// 新目录项在最后
 	
 	return NEWFS_ERROR_NONE;
 }
@@ -119,12 +133,15 @@ int newfs_mkdir(const char* path, mode_t mode) {
  * @param newfs_stat 返回状态
  * @return int 0成功，否则失败
  */
-int newfs_getattr(const char* path, struct stat * newfs_stat) {
+static int newfs_do_getattr(const char* path, struct stat * newfs_stat) {
 	/* TODO: 解析路径，获取Inode，填充newfs_stat，可参考/fs/simplefs/sfs.c的sfs_getattr()函数实现 */
 	// return 0;
 	boolean	is_find, is_root;
 	// 首先找到路径所对应的目录项
 	struct newfs_dentry* dentry = newfs_lookup(path, &is_find, &is_root);
+	if (dentry == NULL) {							/* 路径上的inode读不出来 */
+		return -NEWFS_ERROR_IO;
+	}
 	if (is_find == FALSE) {
 		return -NEWFS_ERROR_NOTFOUND;
 	}
@@ -176,7 +193,7 @@ int newfs_getattr(const char* path, struct stat * newfs_stat) {
  * @param fi 可忽略
  * @return int 0成功，否则失败
  */
-int newfs_readdir(const char * path, void * buf, fuse_fill_dir_t filler, off_t offset,
+static int newfs_do_readdir(const char * path, void * buf, fuse_fill_dir_t filler, off_t offset,
 			    		 struct fuse_file_info * fi) {
     /* TODO: 解析路径，获取目录的Inode，并读取目录项，利用filler填充到buf，可参考/fs/simplefs/sfs.c的sfs_readdir()函数实现 */
     // return 0;
@@ -184,6 +201,9 @@ int newfs_readdir(const char * path, void * buf, fuse_fill_dir_t filler, off_t o
 	int		cur_dir = offset;
 	printf("readdir offset:%d\n", offset);
 	struct newfs_dentry *dentry = newfs_lookup(path, &is_find, &is_root);
+	if (dentry == NULL) {							/* 路径上的inode读不出来 */
+		return -NEWFS_ERROR_IO;
+	}
 	printf("readdir name:%s\n", dentry->name);
 	struct newfs_dentry* sub_dentry;
 	struct newfs_inode* inode;
@@ -206,7 +226,7 @@ int newfs_readdir(const char * path, void * buf, fuse_fill_dir_t filler, off_t o
  * @param dev 设备类型，可忽略
  * @return int 0成功，否则失败
  */
-int newfs_mknod(const char* path, mode_t mode, dev_t dev) {
+static int newfs_do_mknod(const char* path, mode_t mode, dev_t dev) {
 	/* TODO: 解析路径，并创建相应的文件 */
 	// return 0;
 	boolean	is_find, is_root;
@@ -215,6 +235,9 @@ int newfs_mknod(const char* path, mode_t mode, dev_t dev) {
 	struct newfs_dentry* dentry;
 	struct newfs_inode* inode;
 	char* fname;
+	if (last_dentry == NULL) {							/* 路径上的inode读不出来 */
+		return -NEWFS_ERROR_IO;
+	}
 	
 	// 文件已存在
 	if (is_find == TRUE) {
@@ -235,6 +258,7 @@ int newfs_mknod(const char* path, mode_t mode, dev_t dev) {
 	dentry->parent = last_dentry;
 	inode = newfs_alloc_inode(dentry, FALSE);
 	newfs_alloc_dentry(last_dentry->inode, dentry);
+	newfs_dirty_dentrys(last_dentry->inode, last_dentry->inode->dir_cnt - 1);
 
 	return NEWFS_ERROR_NONE;
 }
@@ -263,12 +287,18 @@ int newfs_utimens(const char* path, const struct timespec tv[2]) {
  * @param fi 可忽略
  * @return int 写入大小
  */
-int newfs_write(const char* path, const char* buf, size_t size, off_t offset,
+static int newfs_do_write(const char* path, const char* buf, size_t size, off_t offset,
 		        struct fuse_file_info* fi) {
 	printf("write\n");
 	boolean is_find, is_root;
 	struct newfs_dentry* dentry = newfs_lookup(path, &is_find, &is_root);
 	struct newfs_inode*  inode;
+	uint8_t* data;
+	int blk, blk_ofs, len, done;
+	int max_sz = NEWFS_MAX_FILE_BLKS() * NEWFS_BLK_SZ();
+	if (dentry == NULL) {							/* 路径上的inode读不出来 */
+		return -NEWFS_ERROR_IO;
+	}
 	
 	if (is_find == FALSE) {
 		return -NEWFS_ERROR_NOTFOUND;
@@ -286,10 +316,34 @@ int newfs_write(const char* path, const char* buf, size_t size, off_t offset,
 		return -NEWFS_ERROR_SEEK;
 	}
 
-	memcpy(inode->data + offset, buf, size);
-	inode->size = offset + size > inode->size ? offset + size : inode->size;
+	if (offset + size > max_sz) {					/* 直接块+一次间接+二次间接 */
+		size = offset < max_sz ? max_sz - offset : 0;
+		if (size == 0) {
+			return -NEWFS_ERROR_NOSPACE;
+		}
+	}
+
+	// 逐块写入，只有部分覆盖的块需要先读入原有内容
+	for (done = 0; done < size; done += len) {
+		blk     = (offset + done) / NEWFS_BLK_SZ();
+		blk_ofs = (offset + done) % NEWFS_BLK_SZ();
+		len     = NEWFS_BLK_SZ() - blk_ofs < size - done ? NEWFS_BLK_SZ() - blk_ofs : size - done;
+		data    = newfs_file_block(inode, blk, len < NEWFS_BLK_SZ());
+		if (data == NULL) {
+			return -NEWFS_ERROR_IO;
+		}
+		if (newfs_dirty_blk(inode, blk, FALSE) != NEWFS_ERROR_NONE) {	/* 只预留，刷写时才分配数据块 */
+			break;
+		}
+		memcpy(data + blk_ofs, buf + done, len);
+	}
+	if (done == 0) {
+		return -NEWFS_ERROR_NOSPACE;
+	}
+	inode->size = offset + done > inode->size ? offset + done : inode->size;
+	newfs_dirty_data(inode, offset, done);
 	
-	return size;
+	return done;
 }
 
 /**
@@ -302,11 +356,16 @@ int newfs_write(const char* path, const char* buf, size_t size, off_t offset,
  * @param fi 可忽略
  * @return int 读取大小
  */
-int newfs_read(const char* path, char* buf, size_t size, off_t offset,
+static int newfs_do_read(const char* path, char* buf, size_t size, off_t offset,
 		       struct fuse_file_info* fi) {
 	boolean	is_find, is_root;
 	struct newfs_dentry* dentry = newfs_lookup(path, &is_find, &is_root);
 	struct newfs_inode*  inode;
+	uint8_t* data;
+	int blk, blk_ofs, len, done;
+	if (dentry == NULL) {							/* 路径上的inode读不出来 */
+		return -NEWFS_ERROR_IO;
+	}
 
 	if (is_find == FALSE) {
 		return -NEWFS_ERROR_NOTFOUND;
@@ -322,7 +381,21 @@ int newfs_read(const char* path, char* buf, size_t size, off_t offset,
 		return -NEWFS_ERROR_SEEK;
 	}
 
-	memcpy(buf, inode->data + offset, size);
+	if (offset + size > inode->size) {					/* 读到文件末尾为止 */
+		size = inode->size - offset;
+	}
+
+	// 逐块读取，首次访问的块才从磁盘读入
+	for (done = 0; done < size; done += len) {
+		blk     = (offset + done) / NEWFS_BLK_SZ();
+		blk_ofs = (offset + done) % NEWFS_BLK_SZ();
+		len     = NEWFS_BLK_SZ() - blk_ofs < size - done ? NEWFS_BLK_SZ() - blk_ofs : size - done;
+		data    = newfs_file_block(inode, blk, TRUE);
+		if (data == NULL) {
+			return -NEWFS_ERROR_IO;
+		}
+		memcpy(buf + done, data + blk_ofs, len);
+	}
 
 	return size;			   
 }
@@ -333,12 +406,15 @@ int newfs_read(const char* path, char* buf, size_t size, off_t offset,
  * @param path 相对于挂载点的路径
  * @return int 0成功，否则失败
  */
-int newfs_unlink(const char* path) {
+static int newfs_do_unlink(const char* path) {
 	printf("ljx:unlink!\n");
 	boolean is_find, is_root;
 	printf("path:%s\n", path);
 	struct newfs_dentry *dentry = newfs_lookup(path, &is_find, &is_root);
 	struct newfs_inode*  inode;
+	if (dentry == NULL) {							/* 路径上的inode读不出来 */
+		return -NEWFS_ERROR_IO;
+	}
 	printf("is_find:%d\n", is_find);
 	if (is_find == FALSE)
 	{
@@ -347,7 +423,9 @@ int newfs_unlink(const char* path) {
 
 	inode = dentry->inode;
 
-	newfs_drop_inode(inode);
+	if (newfs_drop_inode(inode) < 0) {				/* 子目录中的inode读不出来 */
+		return -NEWFS_ERROR_IO;
+	}
 	printf("drop dentry cnt before:%d\n",dentry->parent->inode->dir_cnt);
 	printf("drop dentry cnt after:%d\n",newfs_drop_dentry(dentry->parent->inode, dentry));
 	return NEWFS_ERROR_NONE;
@@ -365,9 +443,9 @@ int newfs_unlink(const char* path) {
  * @param path 相对于挂载点的路径
  * @return int 0成功，否则失败
  */
-int newfs_rmdir(const char* path) {
+static int newfs_do_rmdir(const char* path) {
 	printf("ljx:rmdir\n");
-	return newfs_unlink(path);
+	return newfs_do_unlink(path);
 }
 
 /**
@@ -437,14 +515,95 @@ int newfs_access(const char* path, int type) {
 	return 0;
 }	
 /******************************************************************************
+* SECTION: 加锁入口
+* FUSE多线程调用以下操作，与后台刷写线程共用super.lock；修改类操作记下涉及的块数
+*******************************************************************************/
+int newfs_mkdir(const char* path, mode_t mode) {
+	int ret;
+	pthread_mutex_lock(&super.lock);
+	ret = newfs_do_mkdir(path, mode);
+	if (ret == NEWFS_ERROR_NONE)
+		newfs_flusher_note(2);						/* 新inode和父目录 */
+	pthread_mutex_unlock(&super.lock);
+	return ret;
+}
+
+int newfs_getattr(const char* path, struct stat * newfs_stat) {
+	int ret;
+	pthread_mutex_lock(&super.lock);
+	ret = newfs_do_getattr(path, newfs_stat);
+	pthread_mutex_unlock(&super.lock);
+	return ret;
+}
+
+int newfs_readdir(const char * path, void * buf, fuse_fill_dir_t filler, off_t offset,
+			    		 struct fuse_file_info * fi) {
+	int ret;
+	pthread_mutex_lock(&super.lock);
+	ret = newfs_do_readdir(path, buf, filler, offset, fi);
+	pthread_mutex_unlock(&super.lock);
+	return ret;
+}
+
+int newfs_mknod(const char* path, mode_t mode, dev_t dev) {
+	int ret;
+	pthread_mutex_lock(&super.lock);
+	ret = newfs_do_mknod(path, mode, dev);
+	if (ret == NEWFS_ERROR_NONE)
+		newfs_flusher_note(2);
+	pthread_mutex_unlock(&super.lock);
+	return ret;
+}
+
+int newfs_write(const char* path, const char* buf, size_t size, off_t offset,
+		        struct fuse_file_info* fi) {
+	int ret;
+	pthread_mutex_lock(&super.lock);
+	ret = newfs_do_write(path, buf, size, offset, fi);
+	if (ret > 0)
+		newfs_flusher_note((offset + ret - 1) / NEWFS_BLK_SZ() - offset / NEWFS_BLK_SZ() + 1);
+	pthread_mutex_unlock(&super.lock);
+	return ret;
+}
+
+int newfs_read(const char* path, char* buf, size_t size, off_t offset,
+		       struct fuse_file_info* fi) {
+	int ret;
+	pthread_mutex_lock(&super.lock);
+	ret = newfs_do_read(path, buf, size, offset, fi);
+	pthread_mutex_unlock(&super.lock);
+	return ret;
+}
+
+int newfs_unlink(const char* path) {
+	int ret;
+	pthread_mutex_lock(&super.lock);
+	ret = newfs_do_unlink(path);
+	if (ret == NEWFS_ERROR_NONE)
+		newfs_flusher_note(2);
+	pthread_mutex_unlock(&super.lock);
+	return ret;
+}
+
+int newfs_rmdir(const char* path) {
+	int ret;
+	pthread_mutex_lock(&super.lock);
+	ret = newfs_do_rmdir(path);
+	if (ret == NEWFS_ERROR_NONE)
+		newfs_flusher_note(2);
+	pthread_mutex_unlock(&super.lock);
+	return ret;
+}
+/******************************************************************************
 * SECTION: FUSE入口
 *******************************************************************************/
 int main(int argc, char **argv)
 {
 	int ret;
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
-
-	newfs_options.device = strdup("/home/students/200110515/ddriver");
+	char device[256];
+	snprintf(device, sizeof(device), "%s/ddriver", getenv("HOME") ? getenv("HOME") : ".");
+	newfs_options.device = strdup(device);			 /* 默认$HOME/ddriver，可用--device=指定任意镜像 */
 
 	if (fuse_opt_parse(&args, &newfs_options, option_spec, NULL) == -1)
 		return -1;
@@ -0,0 +1,509 @@
+#include "../include/newfs.h"
+extern struct newfs_super      super;
+
+/******************************************************************************
+* SECTION: 块映射
+* 文件内块号到数据块号的映射，同ext2：NEWFS_DATA_PER_FILE个直接块，之后是一次间接块和二次间接块，
+* 间接块中是NEWFS_PTRS_PER_BLK()个uint32_t块号。间接块是元数据，经过块缓存读写；
+* 任意块号的查找最多经过两个间接块，O(1)。数据块0保留，块号为0表示未分配（空洞）
+*
+* 数据块延迟分配：写入时只预留（连同将来需要的间接块），记在inode->resv_blks和
+* super.resv_data_blks中，刷写时newfs_bmap_alloc再按文件最终大小分配连续的数据块
+*******************************************************************************/
+#define NEWFS_DATA_USED(bno)    (super.map_data[(bno) / UINT8_BITS] & (0x1 << ((bno) % UINT8_BITS)))
+
+/**
+ * @brief 数据区的块数，同时受数据块位图容量限制
+ *
+ * @return uint32_t
+ */
+static uint32_t newfs_data_blks() {
+    uint32_t nr = (NEWFS_DISK_SZ() - super.data_offset) / NEWFS_BLK_SZ();
+
+    if (nr > (uint32_t)NEWFS_BLKS_SZ(super.map_data_blks) * UINT8_BITS) {
+        nr = NEWFS_BLKS_SZ(super.map_data_blks) * UINT8_BITS;
+    }
+    return nr;
+}
+
+/**
+ * @brief 挂载时统计空闲数据块，清空预留
+ */
+void newfs_bmap_init() {
+    uint32_t nr = newfs_data_blks(), bno;
+
+    super.free_data_blks = 0;
+    super.resv_data_blks = 0;
+    for (bno = 0; bno < nr; bno++) {
+        if (!NEWFS_DATA_USED(bno)) {
+            super.free_data_blks++;
+        }
+    }
+}
+
+/**
+ * @brief 在数据块位图中分配一个空闲块，用于间接块
+ *
+ * @return uint32_t 块号，没有空闲块时返回0
+ */
+uint32_t newfs_alloc_data_blk() {
+    uint32_t nr = newfs_data_blks();
+    uint32_t byte_cursor, bit_cursor, bno;
+
+    for (byte_cursor = 0; byte_cursor * UINT8_BITS < nr; byte_cursor++) {
+        if (super.map_data[byte_cursor] == 0xff) {          /* 整字节已占用 */
+            continue;
+        }
+        for (bit_cursor = 0; bit_cursor < UINT8_BITS; bit_cursor++) {
+            bno = byte_cursor * UINT8_BITS + bit_cursor;
+            if (bno >= nr) {
+                return 0;
+            }
+            if ((super.map_data[byte_cursor] & (0x1 << bit_cursor)) == 0) {
+                super.map_data[byte_cursor] |= (0x1 << bit_cursor);
+                super.is_map_dirty = TRUE;
+                super.free_data_blks--;
+                return bno;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief 释放一个数据块
+ *
+ * @param bno
+ */
+void newfs_free_data_blk(uint32_t bno) {
+    super.map_data[bno / UINT8_BITS] &= (uint8_t)(~(0x1 << (bno % UINT8_BITS)));
+    super.is_map_dirty = TRUE;
+    super.free_data_blks++;
+}
+
+/**
+ * @brief 分配一段连续的空闲块：从goal开始找第一段够want块的空闲区，到末尾后从头再找，
+ * 都不够时取找到的最长一段
+ *
+ * @param goal 希望的起始块号，通常紧跟在文件前一块之后
+ * @param want
+ * @param got 实际分配的块数，没有空闲块时为0
+ * @return uint32_t 起始块号
+ */
+static uint32_t newfs_alloc_data_run(uint32_t goal, int want, int* got) {
+    uint32_t nr = newfs_data_blks();
+    uint32_t bno, end, start, best = 0;
+    int pass, len, best_len = 0;
+
+    if (goal == 0 || goal >= nr) {
+        goal = 1;
+    }
+    for (pass = 0; pass < 2 && best_len < want; pass++) {
+        end = pass == 0 ? nr : goal;
+        for (bno = pass == 0 ? goal : 1; bno < end && best_len < want; ) {
+            if (super.map_data[bno / UINT8_BITS] == 0xff) {     /* 整字节已占用 */
+                bno = (bno / UINT8_BITS + 1) * UINT8_BITS;
+                continue;
+            }
+            if (NEWFS_DATA_USED(bno)) {
+                bno++;
+                continue;
+            }
+            for (start = bno, len = 0; bno < nr && len < want && !NEWFS_DATA_USED(bno); bno++) {
+                len++;
+            }
+            if (len > best_len) {
+                best     = start;
+                best_len = len;
+            }
+        }
+    }
+    for (bno = best; bno < best + best_len; bno++) {
+        super.map_data[bno / UINT8_BITS] |= (0x1 << (bno % UINT8_BITS));
+    }
+    if (best_len) {
+        super.is_map_dirty    = TRUE;
+        super.free_data_blks -= best_len;
+    }
+    *got = best_len;
+    return best;
+}
+
+/**
+ * @brief 取间接块table中第idx项，为0且create为TRUE时填入leaf，leaf为0时分配一块；
+ * is_table为TRUE时新分配的块本身也是间接块，需要清零
+ *
+ * @param table 间接块的块号
+ * @param idx
+ * @param create
+ * @param is_table
+ * @param leaf 已分配好的数据块
+ * @return uint32_t 块号，未分配或分配失败返回0
+ */
+static uint32_t newfs_bmap_slot(uint32_t table, int idx, boolean create, boolean is_table,
+                                uint32_t leaf) {
+    uint8_t* block = newfs_cache_get(NEWFS_DATA_BLK(table), TRUE);
+    uint32_t bno;
+
+    if (block == NULL) {
+        return 0;
+    }
+    bno = ((uint32_t *)block)[idx];
+    if (bno || !create) {
+        return bno;
+    }
+    bno = leaf ? leaf : newfs_alloc_data_blk();
+    if (bno == 0) {
+        return 0;
+    }
+    if (is_table) {
+        block = newfs_cache_get(NEWFS_DATA_BLK(bno), FALSE);
+        if (block == NULL) {
+            newfs_free_data_blk(bno);
+            return 0;
+        }
+        memset(block, 0, NEWFS_BLK_SZ());
+        newfs_cache_dirty(block);
+    }
+    block = newfs_cache_get(NEWFS_DATA_BLK(table), TRUE);   /* 上面的newfs_cache_get可能换出了table */
+    if (block == NULL) {
+        return 0;
+    }
+    ((uint32_t *)block)[idx] = bno;
+    newfs_cache_dirty(block);
+    return bno;
+}
+
+/**
+ * @brief inode中的一个块指针，为0且create为TRUE时填入leaf，leaf为0时分配一块
+ *
+ * @param inode
+ * @param pointer 指向inode中的块指针
+ * @param create
+ * @param is_table
+ * @param leaf
+ * @return uint32_t
+ */
+static uint32_t newfs_bmap_root(struct newfs_inode* inode, uint32_t* pointer,
+                                boolean create, boolean is_table, uint32_t leaf) {
+    uint8_t* block;
+    uint32_t bno;
+
+    if (*pointer || !create) {
+        return *pointer;
+    }
+    bno = leaf ? leaf : newfs_alloc_data_blk();
+    if (bno == 0) {
+        return 0;
+    }
+    if (is_table) {
+        block = newfs_cache_get(NEWFS_DATA_BLK(bno), FALSE);
+        if (block == NULL) {
+            newfs_free_data_blk(bno);
+            return 0;
+        }
+        memset(block, 0, NEWFS_BLK_SZ());
+        newfs_cache_dirty(block);
+    }
+    *pointer = bno;
+    newfs_dirty_inode(inode);
+    return bno;
+}
+
+/**
+ * @brief 文件内块号到数据块号，create为TRUE且未分配时把leaf填入映射（连同分配所需的间接块）
+ *
+ * @param inode
+ * @param fblk 文件内块号
+ * @param create
+ * @param leaf 数据块号，为0时新分配一块
+ * @return uint32_t 数据块号，未分配或空间不足时返回0
+ */
+static uint32_t newfs_bmap_map(struct newfs_inode* inode, int fblk, boolean create, uint32_t leaf) {
+    uint32_t table;
+
+    if (fblk < NEWFS_DATA_PER_FILE) {
+        return newfs_bmap_root(inode, &inode->block_pointer[fblk], create, FALSE, leaf);
+    }
+    fblk -= NEWFS_DATA_PER_FILE;
+    if (fblk < NEWFS_PTRS_PER_BLK()) {
+        table = newfs_bmap_root(inode, &inode->ind_pointer, create, TRUE, 0);
+        return table ? newfs_bmap_slot(table, fblk, create, FALSE, leaf) : 0;
+    }
+    fblk -= NEWFS_PTRS_PER_BLK();
+    if (fblk < NEWFS_PTRS_PER_BLK() * NEWFS_PTRS_PER_BLK()) {
+        table = newfs_bmap_root(inode, &inode->dind_pointer, create, TRUE, 0);
+        if (table) {
+            table = newfs_bmap_slot(table, fblk / NEWFS_PTRS_PER_BLK(), create, TRUE, 0);
+        }
+        return table ? newfs_bmap_slot(table, fblk % NEWFS_PTRS_PER_BLK(), create, FALSE, leaf) : 0;
+    }
+    return 0;
+}
+
+/**
+ * @brief 文件内块号到数据块号
+ *
+ * @param inode
+ * @param fblk 文件内块号
+ * @param create 未分配时是否分配（连同所需的间接块）
+ * @return uint32_t 数据块号，未分配或空间不足时返回0
+ */
+uint32_t newfs_bmap(struct newfs_inode* inode, int fblk, boolean create) {
+    return newfs_bmap_map(inode, fblk, create, 0);
+}
+
+/**
+ * @brief 文件内[from, to)中是否有标记为需要写回的块；只在覆盖这段的间接块不存在时调用，
+ * 这时其中的块都没有数据块，需要写回即已预留
+ *
+ * @param inode
+ * @param from
+ * @param to
+ * @return boolean
+ */
+static boolean newfs_bmap_has_dirty(struct newfs_inode* inode, int from, int to) {
+    if (to > inode->blks_cap) {
+        to = inode->blks_cap;
+    }
+    for (; from < to; from++) {
+        if (inode->dirty[from]) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/**
+ * @brief 为文件内第fblk块预留空间：没有数据块时预留一块，以及将来映射它需要的、
+ * 还没有被其他已预留块算进去的间接块
+ *
+ * @param inode
+ * @param fblk 文件内块号，调用者保证dirty数组已覆盖且该块未标记
+ * @param force 空间不足时是否仍然预留
+ * @return int
+ */
+int newfs_bmap_reserve(struct newfs_inode* inode, int fblk, boolean force) {
+    int dind_base = NEWFS_DATA_PER_FILE + NEWFS_PTRS_PER_BLK();
+    int group, need = 1;
+
+    if (newfs_bmap(inode, fblk, FALSE)) {
+        return NEWFS_ERROR_NONE;
+    }
+    if (fblk >= NEWFS_DATA_PER_FILE && fblk < dind_base) {
+        if (inode->ind_pointer == 0 && 
+            !newfs_bmap_has_dirty(inode, NEWFS_DATA_PER_FILE, dind_base)) {
+            need++;
+        }
+    }
+    else if (fblk >= dind_base) {
+        group = (fblk - dind_base) / NEWFS_PTRS_PER_BLK();
+        if ((inode->dind_pointer == 0 || newfs_bmap_slot(inode->dind_pointer, group, FALSE, FALSE, 0) == 0) &&
+            !newfs_bmap_has_dirty(inode, dind_base + group * NEWFS_PTRS_PER_BLK(),
+                                  dind_base + (group + 1) * NEWFS_PTRS_PER_BLK())) {
+            need++;                                     /* 二次间接中的一个间接块 */
+            if (inode->dind_pointer == 0 && 
+                !newfs_bmap_has_dirty(inode, dind_base, NEWFS_MAX_FILE_BLKS())) {
+                need++;                                 /* 二次间接块本身 */
+            }
+        }
+    }
+    if (!force && super.resv_data_blks + need > super.free_data_blks) {
+        return -NEWFS_ERROR_NOSPACE;
+    }
+    inode->resv_blks     += need;
+    super.resv_data_blks += need;
+    return NEWFS_ERROR_NONE;
+}
+
+/**
+ * @brief 为文件中连续的各段待分配块分配连续的数据块，尽量紧跟在文件前一块之后
+ *
+ * @param inode
+ * @return int
+ */
+static int newfs_bmap_alloc_runs(struct newfs_inode* inode) {
+    uint32_t goal = 0, start;
+    int i = 0, n, got, j, ret;
+
+    while (inode->has_dirty_blks && i < inode->blks_cap) {
+        if (!inode->dirty[i]) {
+            i++;
+            continue;
+        }
+        start = newfs_bmap(inode, i, FALSE);
+        if (start) {                                    /* 覆盖写，已有数据块 */
+            goal = start + 1;
+            i++;
+            continue;
+        }
+        for (n = 1; i + n < inode->blks_cap && inode->dirty[i + n] &&
+             newfs_bmap(inode, i + n, FALSE) == 0; n++)
+            ;
+        while (n > 0) {
+            start = newfs_alloc_data_run(goal, n, &got);
+            if (got == 0) {
+                return -NEWFS_ERROR_NOSPACE;
+            }
+            for (j = 0; j < got; j++) {
+                if (newfs_bmap_map(inode, i + j, TRUE, start + j) != start + j) {
+                    /* 间接块已预留，还有空闲块时失败的是间接块的读写 */
+                    ret = super.free_data_blks == 0 ? -NEWFS_ERROR_NOSPACE : -NEWFS_ERROR_IO;
+                    while (j < got) {                   /* 没用上的块还回去 */
+                        newfs_free_data_blk(start + j++);
+                    }
+                    return ret;
+                }
+            }
+            goal = start + got;
+            i   += got;
+            n   -= got;
+        }
+    }
+    return NEWFS_ERROR_NONE;
+}
+
+/**
+ * @brief 延迟分配：为inode中所有已预留的块分配数据块和间接块，并从预留中扣除。
+ * 写回前调用，大文件在磁盘上连续，写回时能合并成大请求
+ *
+ * @param inode
+ * @return int
+ */
+int newfs_bmap_alloc(struct newfs_inode* inode) {
+    int free_blks = super.free_data_blks, used, ret;
+
+    if (inode->resv_blks == 0) {                        /* 需要写回的块都已有数据块 */
+        return NEWFS_ERROR_NONE;
+    }
+    ret  = newfs_bmap_alloc_runs(inode);
+    used = free_blks - super.free_data_blks;
+    if (ret == NEWFS_ERROR_NONE || used > inode->resv_blks) {
+        used = inode->resv_blks;
+    }
+    inode->resv_blks     -= used;
+    super.resv_data_blks -= used;
+    return ret;
+}
+
+/**
+ * @brief 释放一个块并攒成连续的一段，不连续时先丢弃已攒的一段
+ *
+ * @param run 当前一段的起始块号和长度
+ * @param bno 为0时只丢弃已攒的一段
+ */
+static void newfs_free_run(uint32_t run[2], uint32_t bno) {
+    if (bno && run[1] && bno == run[0] + run[1]) {
+        run[1]++;
+    }
+    else {
+        if (run[1]) {
+            newfs_driver_discard(NEWFS_DATA_OFS(run[0]), run[1] * NEWFS_BLK_SZ());
+        }
+        run[0] = bno;
+        run[1] = bno ? 1 : 0;
+    }
+    if (bno) {
+        newfs_free_data_blk(bno);
+    }
+}
+
+/**
+ * @brief 释放间接块table下的所有块，depth为1时其中是数据块，为2时是下一级间接块；最后释放table本身
+ *
+ * @param table
+ * @param depth
+ * @param run
+ */
+static void newfs_free_table(uint32_t table, int depth, uint32_t run[2]) {
+    uint8_t* block = newfs_cache_get(NEWFS_DATA_BLK(table), TRUE);
+    uint32_t* ptrs;
+    int i;
+
+    ptrs = (uint32_t *)malloc(NEWFS_BLK_SZ());          /* 拷出来，释放过程中缓存块可能被换出 */
+    if (block && ptrs) {
+        memcpy(ptrs, block, NEWFS_BLK_SZ());
+        for (i = 0; i < NEWFS_PTRS_PER_BLK(); i++) {
+            if (ptrs[i] == 0) {
+                continue;
+            }
+            if (depth > 1) {
+                newfs_free_table(ptrs[i], depth - 1, run);
+            }
+            else {
+                newfs_free_run(run, ptrs[i]);
+            }
+        }
+    }
+    free(ptrs);
+    newfs_free_run(run, table);
+}
+
+/**
+ * @brief 释放inode的所有数据块和间接块，连续的块一次丢弃
+ *
+ * @param inode
+ */
+void newfs_free_blocks(struct newfs_inode* inode) {
+    uint32_t run[2] = {0, 0};
+    int i;
+
+    super.resv_data_blks -= inode->resv_blks;          /* 还没分配的块只需取消预留 */
+    inode->resv_blks      = 0;
+
+    for (i = 0; i < NEWFS_DATA_PER_FILE; i++) {
+        if (inode->block_pointer[i]) {
+            newfs_free_run(run, inode->block_pointer[i]);
+            inode->block_pointer[i] = 0;
+        }
+    }
+    if (inode->ind_pointer) {
+        newfs_free_table(inode->ind_pointer, 1, run);
+        inode->ind_pointer = 0;
+    }
+    if (inode->dind_pointer) {
+        newfs_free_table(inode->dind_pointer, 2, run);
+        inode->dind_pointer = 0;
+    }
+    newfs_free_run(run, 0);
+}
+
+/**
+ * @brief 保证inode的data和dirty数组能容纳nblks块，按倍数增长
+ *
+ * @param inode
+ * @param nblks
+ * @return int
+ */
+int newfs_inode_grow(struct newfs_inode* inode, int nblks) {
+    uint8_t** data;
+    uint8_t*  dirty;
+    int cap = inode->blks_cap ? inode->blks_cap : NEWFS_DATA_PER_FILE;
+
+    if (nblks <= inode->blks_cap) {
+        return NEWFS_ERROR_NONE;
+    }
+    if (nblks > NEWFS_MAX_FILE_BLKS()) {
+        return -NEWFS_ERROR_NOSPACE;
+    }
+    while (cap < nblks) {
+        cap *= 2;
+    }
+    if (cap > NEWFS_MAX_FILE_BLKS()) {
+        cap = NEWFS_MAX_FILE_BLKS();
+    }
+    data  = (uint8_t **)realloc(inode->data, cap * sizeof(uint8_t *));
+    if (data == NULL) {
+        return -NEWFS_ERROR_NOSPACE;
+    }
+    inode->data = data;
+    dirty = (uint8_t *)realloc(inode->dirty, cap);
+    if (dirty == NULL) {
+        return -NEWFS_ERROR_NOSPACE;
+    }
+    inode->dirty = dirty;
+    memset(inode->data + inode->blks_cap, 0, (cap - inode->blks_cap) * sizeof(uint8_t *));
+    memset(inode->dirty + inode->blks_cap, 0, cap - inode->blks_cap);
+    inode->blks_cap = cap;
+    return NEWFS_ERROR_NONE;
+}
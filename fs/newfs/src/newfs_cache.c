@@ -0,0 +1,347 @@
+#include "../include/newfs.h"
+extern struct newfs_super      super;
+
+/******************************************************************************
+* SECTION: 块缓存
+* 按块号索引，哈希查找，LRU淘汰；所有块在初始化时一次分配，空闲块也挂在LRU链表尾部
+*******************************************************************************/
+#define NEWFS_CACHE()                   (&super.cache)
+#define NEWFS_CACHE_HASH(blkno)         ((blkno) & NEWFS_CACHE()->hash_mask)
+
+/**
+ * @brief 从LRU链表中取下
+ *
+ * @param buf
+ */
+static void newfs_lru_unlink(struct newfs_buf* buf) {
+    struct newfs_cache* cache = NEWFS_CACHE();
+    if (buf->prev)
+        buf->prev->next = buf->next;
+    else
+        cache->lru_head = buf->next;
+    if (buf->next)
+        buf->next->prev = buf->prev;
+    else
+        cache->lru_tail = buf->prev;
+    buf->prev = buf->next = NULL;
+}
+
+/**
+ * @brief 放到LRU链表头（最近使用）
+ *
+ * @param buf
+ */
+static void newfs_lru_push(struct newfs_buf* buf) {
+    struct newfs_cache* cache = NEWFS_CACHE();
+    buf->prev = NULL;
+    buf->next = cache->lru_head;
+    if (cache->lru_head)
+        cache->lru_head->prev = buf;
+    else
+        cache->lru_tail = buf;
+    cache->lru_head = buf;
+}
+
+/**
+ * @brief 在哈希表中查找块
+ *
+ * @param blkno
+ * @return struct newfs_buf* 不在缓存中返回NULL
+ */
+static struct newfs_buf* newfs_hash_find(int blkno) {
+    struct newfs_buf* buf = NEWFS_CACHE()->hash[NEWFS_CACHE_HASH(blkno)];
+    while (buf && buf->blkno != blkno) {
+        buf = buf->hnext;
+    }
+    return buf;
+}
+
+/**
+ * @brief 从哈希表中删除块，之后块变为空闲
+ *
+ * @param buf
+ */
+static void newfs_hash_remove(struct newfs_buf* buf) {
+    struct newfs_buf** cursor = &NEWFS_CACHE()->hash[NEWFS_CACHE_HASH(buf->blkno)];
+    while (*cursor != buf) {
+        cursor = &(*cursor)->hnext;
+    }
+    *cursor = buf->hnext;
+    buf->hnext = NULL;
+    buf->blkno = -1;
+}
+
+/**
+ * @brief 同步写回一个脏块
+ *
+ * @param buf
+ * @return int
+ */
+static int newfs_buf_writeback(struct newfs_buf* buf) {
+    struct newfs_cache* cache = NEWFS_CACHE();
+    if (ddriver_pwrite(NEWFS_DRIVER(), (char *)buf->data, NEWFS_BLK_SZ(),
+                       (off_t)buf->blkno * NEWFS_BLK_SZ()) < 0) {
+        return -NEWFS_ERROR_IO;
+    }
+    buf->dirty = FALSE;
+    cache->dirty_cnt--;
+    cache->writebacks++;
+    return NEWFS_ERROR_NONE;
+}
+
+/**
+ * @brief 建立块缓存，需要在得知IO大小后调用
+ *
+ * @param nblks 容量（块），不大于0时取默认值
+ * @return int
+ */
+int newfs_cache_init(int nblks) {
+    struct newfs_cache* cache = NEWFS_CACHE();
+    int nbuckets = 1, i;
+
+    if (nblks <= 0) {
+        nblks = NEWFS_CACHE_BLKS;
+    }
+    while (nbuckets < nblks) {
+        nbuckets <<= 1;
+    }
+    memset(cache, 0, sizeof(struct newfs_cache));
+    cache->bufs  = (struct newfs_buf *)calloc(nblks, sizeof(struct newfs_buf));
+    cache->arena = (uint8_t *)malloc((size_t)nblks * NEWFS_BLK_SZ());
+    cache->hash  = (struct newfs_buf **)calloc(nbuckets, sizeof(struct newfs_buf *));
+    cache->ra_buf = (uint8_t *)malloc((size_t)NEWFS_PREFETCH_BLKS * NEWFS_BLK_SZ());
+    if (cache->bufs == NULL || cache->arena == NULL || cache->hash == NULL || cache->ra_buf == NULL) {
+        newfs_cache_destroy();
+        return -NEWFS_ERROR_NOSPACE;
+    }
+    cache->nblks     = nblks;
+    cache->hash_mask = nbuckets - 1;
+    for (i = 0; i < nblks; i++) {
+        cache->bufs[i].blkno = -1;
+        cache->bufs[i].data  = cache->arena + (size_t)i * NEWFS_BLK_SZ();
+        newfs_lru_push(&cache->bufs[i]);
+    }
+    return NEWFS_ERROR_NONE;
+}
+
+/**
+ * @brief 释放块缓存，不写回脏块
+ */
+void newfs_cache_destroy() {
+    struct newfs_cache* cache = NEWFS_CACHE();
+    free(cache->bufs);
+    free(cache->arena);
+    free(cache->hash);
+    free(cache->ra_buf);
+    cache->bufs   = NULL;
+    cache->arena  = NULL;
+    cache->hash   = NULL;
+    cache->ra_buf = NULL;
+    cache->nblks = 0;
+}
+
+/**
+ * @brief 取得一个块在缓存中的内容，并设为最近使用
+ * 不在缓存中时淘汰最久未用的块（脏块先写回），fill为TRUE时再从设备读出
+ * 返回的指针在下一次newfs_cache_get之前有效
+ *
+ * @param blkno 块号，即字节偏移 / NEWFS_BLK_SZ()
+ * @param fill 是否需要块的原有内容，整块覆盖写时为FALSE
+ * @return uint8_t* 失败返回NULL
+ */
+uint8_t* newfs_cache_get(int blkno, boolean fill) {
+    struct newfs_cache* cache = NEWFS_CACHE();
+    struct newfs_buf* buf = newfs_hash_find(blkno);
+    int bucket;
+
+    if (buf) {
+        cache->hits++;
+        newfs_lru_unlink(buf);
+        newfs_lru_push(buf);
+        return buf->data;
+    }
+
+    cache->misses++;
+    buf = cache->lru_tail;
+    if (buf->blkno >= 0) {
+        if (buf->dirty && newfs_buf_writeback(buf) != NEWFS_ERROR_NONE) {
+            return NULL;
+        }
+        newfs_hash_remove(buf);
+        cache->evictions++;
+    }
+    if (fill && ddriver_pread(NEWFS_DRIVER(), (char *)buf->data, NEWFS_BLK_SZ(),
+                              (off_t)blkno * NEWFS_BLK_SZ()) < 0) {
+        return NULL;
+    }
+    buf->blkno = blkno;
+    bucket = NEWFS_CACHE_HASH(blkno);
+    buf->hnext = cache->hash[bucket];
+    cache->hash[bucket] = buf;
+    newfs_lru_unlink(buf);
+    newfs_lru_push(buf);
+    return buf->data;
+}
+
+/**
+ * @brief 只查找不装入：块在缓存中时返回其内容并设为最近使用，否则返回NULL
+ *
+ * @param blkno
+ * @return uint8_t*
+ */
+uint8_t* newfs_cache_lookup(int blkno) {
+    struct newfs_buf* buf = newfs_hash_find(blkno);
+    if (buf == NULL) {
+        return NULL;
+    }
+    NEWFS_CACHE()->hits++;
+    newfs_lru_unlink(buf);
+    newfs_lru_push(buf);
+    return buf->data;
+}
+
+/**
+ * @brief 预读：把一段块中不在缓存里的连续块各用一次设备读装入缓存，已在缓存中的块不动；
+ *        连续段读进挂载时分配的预读缓冲区再分发，超过NEWFS_PREFETCH_BLKS块时分几次读
+ *
+ * @param blkno 起始块号
+ * @param nblks 
+ * @return int 
+ */
+int newfs_cache_prefetch(int blkno, int nblks) {
+    uint8_t* run = NEWFS_CACHE()->ra_buf;
+    uint8_t* data;
+    int start, end, i;
+
+    if (nblks > NEWFS_CACHE()->nblks) {                 /* 预读不应把刚装入的块挤出去 */
+        nblks = NEWFS_CACHE()->nblks;
+    }
+    for (start = blkno; start < blkno + nblks; start = end) {
+        if (newfs_hash_find(start)) {
+            end = start + 1;
+            continue;
+        }
+        for (end = start + 1; end < blkno + nblks && end - start < NEWFS_PREFETCH_BLKS &&
+             newfs_hash_find(end) == NULL; end++)
+            ;
+        if (ddriver_pread(NEWFS_DRIVER(), (char *)run, (end - start) * NEWFS_BLK_SZ(),
+                          (off_t)start * NEWFS_BLK_SZ()) < 0) {
+            return -NEWFS_ERROR_IO;
+        }
+        for (i = start; i < end; i++) {
+            data = newfs_cache_get(i, FALSE);
+            if (data == NULL) {
+                return -NEWFS_ERROR_IO;
+            }
+            memcpy(data, run + (size_t)(i - start) * NEWFS_BLK_SZ(), NEWFS_BLK_SZ());
+        }
+        NEWFS_CACHE()->prefetched += end - start;
+    }
+    return NEWFS_ERROR_NONE;
+}
+
+/**
+ * @brief 标记块已修改
+ *
+ * @param data newfs_cache_get返回的指针
+ */
+void newfs_cache_dirty(uint8_t* data) {
+    struct newfs_cache* cache = NEWFS_CACHE();
+    struct newfs_buf* buf = &cache->bufs[(data - cache->arena) / NEWFS_BLK_SZ()];
+    if (!buf->dirty) {
+        buf->dirty = TRUE;
+        cache->dirty_cnt++;
+    }
+}
+
+/**
+ * @brief 异步写回失败：buf是缓存中的块时重新标记为脏，留给下一次写回；其他写忽略
+ *
+ * @param buf 写请求的数据
+ */
+void newfs_cache_write_failed(char* buf) {
+    struct newfs_cache* cache = NEWFS_CACHE();
+    uint8_t* data = (uint8_t *)buf;
+
+    if (cache->arena != NULL && data >= cache->arena &&
+        data < cache->arena + (size_t)cache->nblks * NEWFS_BLK_SZ()) {
+        newfs_cache_dirty(data);
+    }
+}
+
+/**
+ * @brief 丢弃一段区间在缓存中的块，包括脏块，用于设备丢弃之前
+ *
+ * @param offset 与块对齐
+ * @param size
+ */
+void newfs_cache_invalidate(int offset, int size) {
+    struct newfs_cache* cache = NEWFS_CACHE();
+    struct newfs_buf* buf;
+    int blkno;
+
+    for (blkno = offset / NEWFS_BLK_SZ(); blkno < (offset + size) / NEWFS_BLK_SZ(); blkno++) {
+        buf = newfs_hash_find(blkno);
+        if (buf == NULL) {
+            continue;
+        }
+        if (buf->dirty) {
+            buf->dirty = FALSE;
+            cache->dirty_cnt--;
+        }
+        newfs_hash_remove(buf);
+        newfs_lru_unlink(buf);                          /* 空闲块放到表尾，最先被复用 */
+        buf->prev = cache->lru_tail;
+        if (cache->lru_tail)
+            cache->lru_tail->next = buf;
+        else
+            cache->lru_head = buf;
+        cache->lru_tail = buf;
+    }
+}
+
+static int newfs_buf_cmp(const void* a, const void* b) {
+    return (*(struct newfs_buf **)a)->blkno - (*(struct newfs_buf **)b)->blkno;
+}
+
+/**
+ * @brief 写回所有脏块：按块号排序后作为一批异步写提交，相邻的块由驱动合并，等待全部完成。
+ *        提交时清除脏标记，没有写成功的块在收割时由newfs_cache_write_failed重新标脏
+ *
+ * @return int
+ */
+int newfs_cache_flush() {
+    struct newfs_cache* cache = NEWFS_CACHE();
+    struct newfs_buf** dirty;
+    int ret = NEWFS_ERROR_NONE;
+    int i, nr = 0;
+
+    if (cache->dirty_cnt == 0) {
+        return NEWFS_ERROR_NONE;
+    }
+    dirty = (struct newfs_buf **)malloc(cache->dirty_cnt * sizeof(struct newfs_buf *));
+    if (dirty == NULL) {
+        return -NEWFS_ERROR_NOSPACE;
+    }
+    for (i = 0; i < cache->nblks; i++) {
+        if (cache->bufs[i].dirty) {
+            dirty[nr++] = &cache->bufs[i];
+        }
+    }
+    qsort(dirty, nr, sizeof(struct newfs_buf *), newfs_buf_cmp);
+    for (i = 0; i < nr; i++) {
+        dirty[i]->dirty = FALSE;
+        cache->dirty_cnt--;
+        if (newfs_driver_write_async(dirty[i]->blkno * NEWFS_BLK_SZ(), dirty[i]->data,
+                                     NEWFS_BLK_SZ(), NULL) != NEWFS_ERROR_NONE) {
+            newfs_cache_write_failed((char *)dirty[i]->data);   /* 没提交出去，留给下一次写回 */
+            ret = -NEWFS_ERROR_IO;
+        }
+    }
+    cache->writebacks += nr;
+    free(dirty);
+    if (newfs_driver_drain() != NEWFS_ERROR_NONE) {     /* 完成前块内容不能被修改 */
+        ret = -NEWFS_ERROR_IO;
+    }
+    return ret;
+}
@@ -0,0 +1,115 @@
+#include "../include/newfs.h"
+#include <sys/time.h>
+extern struct newfs_super      super;
+
+/******************************************************************************
+* SECTION: 后台刷写
+* 刷写线程周期性地把修改过的inode、目录项、位图和缓存脏块写回，修改量达到脏块比例时提前唤醒；
+* 卸载时只需写回最后一个周期内的修改。所有FUSE操作和刷写线程都持有super.lock
+*******************************************************************************/
+/**
+ * @brief 修改量是否达到提前刷写的比例
+ *
+ * @return boolean
+ */
+static boolean newfs_flusher_over_ratio() {
+    return (long)(super.dirty_blks + super.cache.dirty_cnt) * 100 >=
+           (long)super.dirty_ratio * super.cache.nblks;
+}
+
+/**
+ * @brief 刷写线程：等到周期到期或被提前唤醒，有修改时把整个文件系统写回一次；
+ *        写回失败后修改量仍计在脏块数中，只等周期到期再重试
+ *
+ * @param arg 未使用
+ * @return void*
+ */
+static void* newfs_flusher(void* arg) {
+    struct timeval  now;
+    struct timespec deadline;
+    boolean failed = FALSE;
+    int ret;
+
+    (void)arg;
+    pthread_mutex_lock(&super.lock);
+    while (!super.flusher_stop) {
+        gettimeofday(&now, NULL);
+        deadline.tv_sec  = now.tv_sec + super.flush_ms / 1000;
+        deadline.tv_nsec = now.tv_usec * 1000L + (super.flush_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        ret = 0;
+        while (!super.flusher_stop && (failed || !newfs_flusher_over_ratio()) && ret != ETIMEDOUT) {
+            ret = pthread_cond_timedwait(&super.flusher_cond, &super.lock, &deadline);
+        }
+        if (super.flusher_stop) {
+            break;
+        }
+        if (super.dirty_blks == 0 && super.cache.dirty_cnt == 0) {
+            continue;
+        }
+        failed = newfs_sync_fs() != NEWFS_ERROR_NONE;
+        if (failed) {                               /* 修改量保留，留给下一个周期或卸载 */
+            printf("flusher: write back failed\n");
+        }
+        super.flushes++;
+    }
+    pthread_mutex_unlock(&super.lock);
+    return NULL;
+}
+
+/**
+ * @brief 初始化全局锁，并按参数启动刷写线程，需要在挂载成功后调用
+ *
+ * @param flush_ms 刷写周期（毫秒），为0时取默认值，负数不启动线程，只在卸载时写回
+ * @param dirty_ratio 提前刷写的脏块比例（百分比），不大于0时取默认值
+ * @return int
+ */
+int newfs_flusher_start(int flush_ms, int dirty_ratio) {
+    pthread_mutex_init(&super.lock, NULL);
+    pthread_cond_init(&super.flusher_cond, NULL);
+    super.flush_ms     = flush_ms == 0 ? NEWFS_FLUSH_MS : flush_ms;
+    super.dirty_ratio  = dirty_ratio <= 0 ? NEWFS_DIRTY_RATIO : dirty_ratio;
+    super.dirty_blks   = 0;
+    super.flushes      = 0;
+    super.flusher_stop = FALSE;
+    super.flusher_on   = FALSE;
+    if (super.flush_ms < 0) {
+        return NEWFS_ERROR_NONE;
+    }
+    if (pthread_create(&super.flusher, NULL, newfs_flusher, NULL) != 0) {
+        return -NEWFS_ERROR_NOSPACE;
+    }
+    super.flusher_on = TRUE;
+    return NEWFS_ERROR_NONE;
+}
+
+/**
+ * @brief 通知刷写线程退出并等待，之后剩余的修改由卸载写回
+ */
+void newfs_flusher_stop() {
+    if (super.flusher_on) {
+        pthread_mutex_lock(&super.lock);
+        super.flusher_stop = TRUE;
+        pthread_cond_signal(&super.flusher_cond);
+        pthread_mutex_unlock(&super.lock);
+        pthread_join(super.flusher, NULL);
+        super.flusher_on = FALSE;
+    }
+    pthread_cond_destroy(&super.flusher_cond);
+    pthread_mutex_destroy(&super.lock);
+}
+
+/**
+ * @brief 记录一次修改，持有super.lock时调用；修改量达到脏块比例时提前唤醒刷写线程
+ *
+ * @param blks 修改涉及的块数
+ */
+void newfs_flusher_note(int blks) {
+    super.dirty_blks += blks;
+    if (super.flusher_on && newfs_flusher_over_ratio()) {
+        pthread_cond_signal(&super.flusher_cond);
+    }
+}
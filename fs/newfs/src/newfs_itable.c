@@ -0,0 +1,83 @@
+#include "../include/newfs.h"
+extern struct newfs_super      super;
+
+/******************************************************************************
+* SECTION: inode表
+* inode表按块读写：一个块放NEWFS_BLK_SZ() / NEWFS_INODE_PER_FILE个inode，整块经过块缓存，
+* 同一块中的相邻inode之后直接从缓存取出；修改只标记缓存块为脏，写回时相邻的块合并成一次IO
+* 磁盘inode与内存中的newfs_inode_d布局相同，解码即拷贝
+*******************************************************************************/
+/**
+ * @brief 读出一个磁盘inode，所在的inode表块不在缓存中时整块读入
+ *
+ * @param ino
+ * @param inode_d 输出
+ * @return int
+ */
+int newfs_itable_read(int ino, struct newfs_inode_d* inode_d) {
+    uint8_t* block = newfs_cache_get(NEWFS_INO_BLK(ino), TRUE);
+    if (block == NULL) {
+        return -NEWFS_ERROR_IO;
+    }
+    memcpy(inode_d, block + NEWFS_INO_OFS(ino) % NEWFS_BLK_SZ(), sizeof(struct newfs_inode_d));
+    return NEWFS_ERROR_NONE;
+}
+
+/**
+ * @brief 写入一个磁盘inode，只修改缓存中的inode表块，由newfs_cache_flush写回
+ *
+ * @param inode_d inode_d->ino决定位置
+ * @return int
+ */
+int newfs_itable_write(struct newfs_inode_d* inode_d) {
+    uint8_t* block = newfs_cache_get(NEWFS_INO_BLK(inode_d->ino), TRUE);
+    if (block == NULL) {
+        return -NEWFS_ERROR_IO;
+    }
+    memcpy(block + NEWFS_INO_OFS(inode_d->ino) % NEWFS_BLK_SZ(), inode_d, sizeof(struct newfs_inode_d));
+    newfs_cache_dirty(block);
+    return NEWFS_ERROR_NONE;
+}
+
+static int newfs_blkno_cmp(const void* a, const void* b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+/**
+ * @brief 目录读入后预读其中尚未读入的子inode所在的inode表块，
+ * 按块号排序去重后，连续的块一次读入；之后逐个stat子文件都在缓存中命中
+ *
+ * @param inode 目录的inode
+ * @return int
+ */
+int newfs_itable_readahead(struct newfs_inode* inode) {
+    struct newfs_dentry* dentry_cursor;
+    int* blknos;
+    int  nr = 0, i, start;
+    int  ret = NEWFS_ERROR_NONE;
+
+    if (inode->dir_cnt == 0) {
+        return NEWFS_ERROR_NONE;
+    }
+    blknos = (int *)malloc(inode->dir_cnt * sizeof(int));
+    if (blknos == NULL) {
+        return -NEWFS_ERROR_NOSPACE;
+    }
+    for (dentry_cursor = inode->dentrys; dentry_cursor; dentry_cursor = dentry_cursor->brother) {
+        if (dentry_cursor->inode == NULL) {
+            blknos[nr++] = NEWFS_INO_BLK(dentry_cursor->ino);
+        }
+    }
+    qsort(blknos, nr, sizeof(int), newfs_blkno_cmp);
+    for (i = 0, start = 0; i < nr; i++) {
+        if (i + 1 < nr && blknos[i + 1] <= blknos[i] + 1) {   /* 同一块或相邻块 */
+            continue;
+        }
+        if (newfs_cache_prefetch(blknos[start], blknos[i] - blknos[start] + 1) != NEWFS_ERROR_NONE) {
+            ret = -NEWFS_ERROR_IO;
+        }
+        start = i + 1;
+    }
+    free(blknos);
+    return ret;
+}
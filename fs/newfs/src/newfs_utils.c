@@ -3,7 +3,37 @@ extern struct newfs_super      super;
 extern struct custom_options newfs_options;
 
 /**
- * @brief 驱动读
+ * @brief 整块读的快速路径：缓存中的块直接拷贝，其余连续的块从设备直接读进调用者的缓冲区
+ * 不装入缓存，避免大块数据把元数据挤出去
+ * 
+ * @param blkno 起始块号
+ * @param out_content 
+ * @param nblks 
+ * @return int 
+ */
+static int newfs_driver_read_direct(int blkno, uint8_t *out_content, int nblks) {
+    int      start = 0, i;
+    uint8_t* block;
+    for (i = 0; i <= nblks; i++) {
+        block = i < nblks ? newfs_cache_lookup(blkno + i) : NULL;
+        if (i < nblks && block == NULL) {
+            continue;
+        }
+        if (i > start && ddriver_pread(NEWFS_DRIVER(), (char *)out_content + start * NEWFS_BLK_SZ(),
+                                       (i - start) * NEWFS_BLK_SZ(),
+                                       (off_t)(blkno + start) * NEWFS_BLK_SZ()) < 0) {
+            return -NEWFS_ERROR_IO;
+        }
+        if (block) {
+            memcpy(out_content + i * NEWFS_BLK_SZ(), block, NEWFS_BLK_SZ());
+        }
+        start = i + 1;
+    }
+    return NEWFS_ERROR_NONE;
+}
+
+/**
+ * @brief 驱动读，整块对齐的请求走快速路径，其余经过块缓存
  * 1 block = 2 io unit
  * @param offset 
  * @param out_content 
@@ -11,27 +41,33 @@ extern struct custom_options newfs_options;
  * @return int 
  */
 int newfs_driver_read(int offset, uint8_t *out_content, int size) {
-    int      offset_aligned = NEWFS_ROUND_DOWN(offset, NEWFS_BLK_SZ());
-    int      bias           = offset - offset_aligned;
-    int      size_aligned   = NEWFS_ROUND_UP((size + bias), NEWFS_BLK_SZ());
-    uint8_t* temp_content   = (uint8_t*)malloc(size_aligned);
-    uint8_t* cur            = temp_content;
-    // lseek(SFS_DRIVER(), offset_aligned, SEEK_SET);
-    ddriver_seek(NEWFS_DRIVER(), offset_aligned, SEEK_SET);
-    while (size_aligned != 0)
-    {
-        // read(SFS_DRIVER(), cur, SFS_IO_SZ());
-        ddriver_read(NEWFS_DRIVER(), cur, NEWFS_IO_SZ());   // 以io单元为单位
-        cur          += NEWFS_IO_SZ();
-        size_aligned -= NEWFS_IO_SZ();   
+    int      blkno;
+    int      bias;
+    int      len;
+    uint8_t* block;
+    if (offset % NEWFS_BLK_SZ() == 0 && size % NEWFS_BLK_SZ() == 0) {
+        return newfs_driver_read_direct(offset / NEWFS_BLK_SZ(), out_content, 
+                                        size / NEWFS_BLK_SZ());
+    }
+    while (size > 0) {
+        blkno = offset / NEWFS_BLK_SZ();
+        bias  = offset - blkno * NEWFS_BLK_SZ();
+        len   = NEWFS_BLK_SZ() - bias < size ? NEWFS_BLK_SZ() - bias : size;
+        block = newfs_cache_get(blkno, TRUE);
+        if (block == NULL) {
+            return -NEWFS_ERROR_IO;
+        }
+        memcpy(out_content, block + bias, len);
+        out_content += len;
+        offset      += len;
+        size        -= len;
     }
-    memcpy(out_content, temp_content + bias, size);
-    free(temp_content);
     return NEWFS_ERROR_NONE;
 }
 
 /**
- * @brief 驱动写
+ * @brief 驱动写，整块对齐的请求从调用者的缓冲区一次写到设备，缓存中的旧副本作废
+ * 其余只修改块缓存并标记为脏，由newfs_cache_flush统一写回
  * 
  * @param offset 
  * @param in_content 
@@ -39,30 +75,217 @@ int newfs_driver_read(int offset, uint8_t *out_content, int size) {
  * @return int 
  */
 int newfs_driver_write(int offset, uint8_t *in_content, int size) {
-    int      offset_aligned = NEWFS_ROUND_DOWN(offset, NEWFS_BLK_SZ());
-    int      bias           = offset - offset_aligned;
-    int      size_aligned   = NEWFS_ROUND_UP((size + bias), NEWFS_BLK_SZ());
-    uint8_t* temp_content   = (uint8_t*)malloc(size_aligned);
-    uint8_t* cur            = temp_content;
-    newfs_driver_read(offset_aligned, temp_content, size_aligned);  // 读出块
-    memcpy(temp_content + bias, in_content, size);                  // 修改写的部分
-    
-    // lseek(SFS_DRIVER(), offset_aligned, SEEK_SET);
-    ddriver_seek(NEWFS_DRIVER(), offset_aligned, SEEK_SET);
-    while (size_aligned != 0)
-    {
-        // write(SFS_DRIVER(), cur, SFS_IO_SZ());
-        ddriver_write(NEWFS_DRIVER(), cur, NEWFS_IO_SZ());  // 以io单元为单位
-        cur          += NEWFS_IO_SZ();
-        size_aligned -= NEWFS_IO_SZ();   
+    int      blkno;
+    int      bias;
+    int      len;
+    uint8_t* block;
+    if (offset % NEWFS_BLK_SZ() == 0 && size % NEWFS_BLK_SZ() == 0) {
+        newfs_cache_invalidate(offset, size);
+        if (ddriver_pwrite(NEWFS_DRIVER(), (char *)in_content, size, offset) < 0) {
+            return -NEWFS_ERROR_IO;
+        }
+        return NEWFS_ERROR_NONE;
+    }
+    while (size > 0) {
+        blkno = offset / NEWFS_BLK_SZ();
+        bias  = offset - blkno * NEWFS_BLK_SZ();
+        len   = NEWFS_BLK_SZ() - bias < size ? NEWFS_BLK_SZ() - bias : size;
+        block = newfs_cache_get(blkno, len < NEWFS_BLK_SZ());   // 整块覆盖时不需要先读出
+        if (block == NULL) {
+            return -NEWFS_ERROR_IO;
+        }
+        memcpy(block + bias, in_content, len);
+        newfs_cache_dirty(block);
+        in_content += len;
+        offset     += len;
+        size       -= len;
+    }
+    return NEWFS_ERROR_NONE;
+}
+
+/**
+ * @brief 异步写没有写成功：文件数据标记所属文件，缓存块重新标脏，都留给下一次刷写
+ *
+ * @param req
+ */
+static void newfs_driver_write_failed(struct ddriver_req* req) {
+    if (req->priv != NULL) {
+        ((struct newfs_inode *)req->priv)->wb_failed = TRUE;
+    }
+    else {
+        newfs_cache_write_failed(req->buf);
+    }
+}
+
+/**
+ * @brief 收割已完成的异步写请求
+ * 
+ * @param min_nr 至少等待完成的请求数
+ * @return int 
+ */
+static int newfs_driver_reap(int min_nr) {
+    struct ddriver_req* events[NEWFS_AIO_BATCH];
+    int ret = NEWFS_ERROR_NONE;
+    int n, i;
+
+    n = ddriver_getevents(NEWFS_DRIVER(), min_nr, NEWFS_AIO_BATCH, events);
+    for (i = 0; i < n; i++) {
+        if (events[i]->res != (int)events[i]->size) {
+            newfs_driver_write_failed(events[i]);
+            ret = -NEWFS_ERROR_IO;
+        }
+        free(events[i]);
     }
+    super.aio_inflight -= n;
+    return ret;
+}
+
+/**
+ * @brief 一次提交所有攒下的异步写，驱动调度器可以在整批请求中排序合并
+ * 
+ * @return int 
+ */
+static int newfs_driver_unplug() {
+    int ret = NEWFS_ERROR_NONE;
+    int i, nr = super.aio_plugged;
 
-    free(temp_content);
+    if (nr == 0) {
+        return NEWFS_ERROR_NONE;
+    }
+    super.aio_plugged = 0;
+    if (ddriver_submit(NEWFS_DRIVER(), super.aio_plug, nr) < 0) {
+        for (i = 0; i < nr; i++) {                              // 提交失败退回同步写
+            if (ddriver_pwrite(NEWFS_DRIVER(), super.aio_plug[i]->buf, super.aio_plug[i]->size,
+                               super.aio_plug[i]->offset) != (int)super.aio_plug[i]->size) {
+                newfs_driver_write_failed(super.aio_plug[i]);
+                ret = -NEWFS_ERROR_IO;
+            }
+            free(super.aio_plug[i]);
+        }
+        return ret;
+    }
+    super.aio_inflight += nr;
+
+    return newfs_driver_reap(0);                                // 顺便收割已完成的请求
+}
+
+/**
+ * @brief 异步驱动写，仅用于块对齐的整块写（如文件数据块、块缓存写回），零拷贝，不需要读改写
+ * 不经过块缓存，调用者保证缓存中没有这些块的脏副本
+ * 请求先攒在aio_plug中，满了或newfs_driver_drain时再一起提交
+ * 数据在newfs_driver_drain返回之前不能释放或修改
+ * 
+ * @param offset 
+ * @param in_content 
+ * @param size 
+ * @param owner 数据所属的文件，写失败时置其wb_failed；块缓存写回传NULL
+ * @return int 
+ */
+int newfs_driver_write_async(int offset, uint8_t *in_content, int size, struct newfs_inode* owner) {
+    struct ddriver_req* req;
+
+    if (offset % NEWFS_BLK_SZ() != 0 || size % NEWFS_BLK_SZ() != 0) {
+        return -NEWFS_ERROR_INVAL;
+    }
+
+    req         = (struct ddriver_req*)malloc(sizeof(struct ddriver_req));
+    if (req == NULL) {
+        return -NEWFS_ERROR_NOSPACE;
+    }
+    req->op     = DDRIVER_OP_WRITE;
+    req->flags  = 0;
+    req->buf    = (char *)in_content;
+    req->size   = size;
+    req->offset = offset;
+    req->priv   = owner;
+    super.aio_plug[super.aio_plugged++] = req;
+
+    if (super.aio_plugged == NEWFS_AIO_PLUG) {
+        return newfs_driver_unplug();
+    }
+    return NEWFS_ERROR_NONE;
+}
+
+/**
+ * @brief 通知设备一段数据不再使用，设备可以回收（打洞），之后读回全0
+ * 只是提示，设备不支持时忽略
+ * 
+ * @param offset 
+ * @param size 
+ * @return int 
+ */
+int newfs_driver_discard(int offset, int size) {
+    struct ddriver_discard discard;
+    newfs_cache_invalidate(offset, size);                       // 缓存中的块不必再写回
+    discard.offset = offset;
+    discard.len    = size;
+    ddriver_ioctl(NEWFS_DRIVER(), IOC_REQ_DEVICE_DISCARD, &discard);
     return NEWFS_ERROR_NONE;
 }
 
 /**
- * @brief 分配一个inode，占用位图；以及分配数据块
+ * @brief 等待所有在飞的异步写完成
+ * 
+ * @return int 
+ */
+int newfs_driver_drain() {
+    int ret = newfs_driver_unplug();
+    while (super.aio_inflight > 0) {
+        if (newfs_driver_reap(1) != NEWFS_ERROR_NONE) {
+            ret = -NEWFS_ERROR_IO;
+        }
+    }
+    return ret;
+}
+
+/**
+ * @brief 载入位图：优先直接使用设备镜像映射原地访问，不支持时退回malloc并读出
+ * 
+ * @param offset 位图起始地址
+ * @param blks 位图占用块数
+ * @return uint8_t* 
+ */
+static uint8_t* newfs_load_bitmap(int offset, int blks) {
+    uint8_t* map = (uint8_t *)ddriver_map_block(NEWFS_DRIVER(), offset / NEWFS_IO_SZ());
+    if (map != NULL) {
+        super.is_map_in_place = TRUE;
+        return map;
+    }
+    super.is_map_in_place = FALSE;
+    map = (uint8_t *)malloc(NEWFS_BLKS_SZ(blks));
+    if (newfs_driver_read(offset, map, NEWFS_BLKS_SZ(blks)) != NEWFS_ERROR_NONE) {
+        free(map);
+        return NULL;
+    }
+    return map;
+}
+
+/**
+ * @brief 写回位图：原地映射的只需标记脏IO单位，由ddriver_flush_map统一写回
+ * 
+ * @param map 
+ * @param offset 
+ * @param blks 
+ * @return int 
+ */
+static int newfs_store_bitmap(uint8_t* map, int offset, int blks) {
+    int ret = NEWFS_ERROR_NONE;
+    int blkno;
+    if (super.is_map_in_place) {
+        for (blkno = offset / NEWFS_IO_SZ(); 
+             blkno < (offset + NEWFS_BLKS_SZ(blks)) / NEWFS_IO_SZ(); blkno++) {
+            ddriver_dirty_block(NEWFS_DRIVER(), blkno);
+        }
+        return ret;
+    }
+    if (newfs_driver_write(offset, map, NEWFS_BLKS_SZ(blks)) != NEWFS_ERROR_NONE) {
+        ret = -NEWFS_ERROR_IO;
+    }
+    return ret;
+}
+
+/**
+ * @brief 分配一个inode，占用位图；数据块在刷写时才分配
  * 
  * @param dentry 该dentry指向分配的inode
  * @return newfs_inode
@@ -114,40 +337,23 @@ struct newfs_inode* newfs_alloc_inode(struct newfs_dentry * dentry, boolean is_r
     
     inode->dir_cnt = 0;
     inode->dentrys = NULL;
-    int data_cursor = 0;
-    for (int i = 0; i < NEWFS_DATA_PER_FILE ; i++)
-    {
-        // 在data位图上寻找未使用的数据块
-        is_find_free_entry = FALSE;
-        for (byte_cursor = 0; byte_cursor < NEWFS_BLKS_SZ(super.map_data_blks);
-             byte_cursor++)
-        {
-            for (bit_cursor = 0; bit_cursor < UINT8_BITS; bit_cursor++) {
-                if((super.map_data[byte_cursor] & (0x1 << bit_cursor)) == 0) {    
-                                                        /* 当前ino_cursor位置空闲 */
-                    super.map_data[byte_cursor] |= (0x1 << bit_cursor);
-                    is_find_free_entry = TRUE;     
-                    printf("data cursor:%d\n", data_cursor);
-                    break;
-                }
-                data_cursor++;
-            }
-            if (is_find_free_entry) {
-                break;
-            }
-        }
-        inode->block_pointer[i] = data_cursor;
-        data_cursor = 0;
-    }
-    if (NEWFS_IS_REG(inode)) {
-        inode->data = (uint8_t *)malloc(NEWFS_BLKS_SZ(NEWFS_DATA_PER_FILE));    // 这里是为数据在内存中分配空间
-    }
+    inode->data            = NULL;                    /* 数据缓冲区在写入时分配 */
+    inode->dirty           = NULL;
+    inode->blks_cap        = 0;
+    inode->has_dirty_blks  = FALSE;
+    inode->resv_blks       = 0;
+    inode->has_dirty_child = FALSE;
+    newfs_dirty_inode(inode);                         /* 新inode及位图都要写回 */
+    super.is_map_dirty = TRUE;
+    memset(inode->block_pointer, 0, sizeof(inode->block_pointer));
+    inode->ind_pointer  = 0;
+    inode->dind_pointer = 0;
 
     return inode;
 }
 
 /**
- * @brief 将内存inode及其下方结构全部刷回磁盘
+ * @brief 将内存inode及其下方结构中修改过的部分刷回磁盘，没有修改的子树直接跳过
  * 
  * @param inode 
  * @return int 
@@ -155,105 +361,231 @@ struct newfs_inode* newfs_alloc_inode(struct newfs_dentry * dentry, boolean is_r
 int newfs_sync_inode(struct newfs_inode * inode) {
     struct newfs_inode_d  inode_d;
     struct newfs_dentry*  dentry_cursor;
-    struct newfs_dentry_d dentry_d;
+    struct newfs_dentry_d* dentry_d;
+    uint8_t* blk;
+    boolean is_blk_dirty;
     int ino             = inode->ino;
-    inode_d.ino         = ino;
-    inode_d.size        = inode->size;
-    memcpy(inode_d.target_path, inode->target_path, MAX_NAME_LEN);
-    inode_d.ftype       = inode->dentry->ftype;
-    inode_d.dir_cnt     = inode->dir_cnt;
-    int offset;
-    for (int i = 0; i < NEWFS_DATA_PER_FILE; i++)
-    {
-        inode_d.block_pointer[i] = inode->block_pointer[i];
+    uint32_t bno;
+    int i, j, ret;
+
+    if (!inode->is_dirty && !inode->has_dirty_blks && !inode->has_dirty_child) {
+        return NEWFS_ERROR_NONE;
     }
-    printf("write back ino:%d\n", ino);
-    printf("write inode offset:%x\n", NEWFS_INO_OFS(ino));
-    // 将inode写回磁盘
-    if (newfs_driver_write(NEWFS_INO_OFS(ino), (uint8_t *)&inode_d, 
-                     sizeof(struct newfs_inode_d)) != NEWFS_ERROR_NONE) {
-        // SFS_DBG("[%s] io error\n", __func__);
-        return -NEWFS_ERROR_IO;
+    // 先为修改过的块分配数据块，块指针的变化要随inode一起写回
+    ret = newfs_bmap_alloc(inode);
+    if (ret != NEWFS_ERROR_NONE) {
+        return ret;
+    }
+    if (inode->is_dirty) {
+        inode_d.ino         = ino;
+        inode_d.size        = inode->size;
+        memcpy(inode_d.target_path, inode->target_path, MAX_NAME_LEN);
+        inode_d.ftype       = inode->dentry->ftype;
+        inode_d.dir_cnt     = inode->dir_cnt;
+        for (int i = 0; i < NEWFS_DATA_PER_FILE; i++)
+        {
+            inode_d.block_pointer[i] = inode->block_pointer[i];
+        }
+        inode_d.ind_pointer  = inode->ind_pointer;
+        inode_d.dind_pointer = inode->dind_pointer;
+        printf("write back ino:%d\n", ino);
+        printf("write inode offset:%x\n", NEWFS_INO_OFS(ino));
+        // 将inode写回inode表
+        if (newfs_itable_write(&inode_d) != NEWFS_ERROR_NONE) {
+            // SFS_DBG("[%s] io error\n", __func__);
+            return -NEWFS_ERROR_IO;
+        }
     }
                                                       /* Cycle 1: 写 INODE */
                                                       /* Cycle 2: 写 数据 */
-    int i = 0;
-    // 如果是目录
+    // 如果是目录，修改过的目录块在内存中拼好后整块写回
     if (NEWFS_IS_DIR(inode)) {                          
         dentry_cursor = inode->dentrys;
-        // printf("ino:%d\n", inode->ino);
-        offset = NEWFS_DATA_OFS(inode->block_pointer[i]);
-        while (dentry_cursor != NULL)
+        blk = (uint8_t *)malloc(NEWFS_BLK_SZ());
+        if (blk == NULL) {
+            return -NEWFS_ERROR_NOSPACE;
+        }
+        for (i = 0; dentry_cursor != NULL; i++)
         {
-            memcpy(dentry_d.name, dentry_cursor->name, MAX_NAME_LEN);
-            dentry_d.ftype = dentry_cursor->ftype;
-            dentry_d.ino = dentry_cursor->ino;
-            
-            // 将当前目录项写入磁盘
-            // 先判断当前块剩余空间是否足够，不够则读取下一块
-            if (NEWFS_ROUND_DOWN((offset+sizeof(struct newfs_dentry_d)),NEWFS_BLK_SZ()) > NEWFS_ROUND_DOWN(offset,NEWFS_BLK_SZ())){
-                if (++i >= NEWFS_DATA_PER_FILE)     // 最多只能有6块
-                    return NEWFS_ERROR_UNSUPPORTED;
-                offset = NEWFS_DATA_OFS(inode->block_pointer[i]);
+            is_blk_dirty = i < inode->blks_cap && inode->dirty[i];
+            if (is_blk_dirty) {
+                memset(blk, 0, NEWFS_BLK_SZ());
             }
-            printf("dentry offset：%x\n", offset);
-            if (newfs_driver_write(offset, (uint8_t *)&dentry_d, 
-                                 sizeof(struct newfs_dentry_d)) != NEWFS_ERROR_NONE) {
-                // SFS_DBG("[%s] io error\n", __func__);
-                return -NEWFS_ERROR_IO;                     
+            for (j = 0; j < NEWFS_DENTRY_PER_BLK() && dentry_cursor != NULL; j++)
+            {
+                if (is_blk_dirty) {
+                    dentry_d = (struct newfs_dentry_d *)(blk + j * sizeof(struct newfs_dentry_d));
+                    memcpy(dentry_d->name, dentry_cursor->name, MAX_NAME_LEN);
+                    dentry_d->ftype = dentry_cursor->ftype;
+                    dentry_d->ino   = dentry_cursor->ino;
+                }
+                // 递归刷写子树中有修改的inode节点
+                if (inode->has_dirty_child && dentry_cursor->inode != NULL) {
+                    ret = newfs_sync_inode(dentry_cursor->inode);
+                    if (ret != NEWFS_ERROR_NONE) {
+                        free(blk);
+                        return ret;
+                    }
+                }
+                dentry_cursor = dentry_cursor->brother;
             }
-            // 递归刷写每一个目录项对应的inode节点
-            if (dentry_cursor->inode != NULL) {
-                newfs_sync_inode(dentry_cursor->inode);
+            if (is_blk_dirty) {
+                bno = newfs_bmap(inode, i, FALSE);
+                if (newfs_driver_write(NEWFS_DATA_OFS(bno), blk, 
+                                       NEWFS_BLK_SZ()) != NEWFS_ERROR_NONE) {
+                    // SFS_DBG("[%s] io error\n", __func__);
+                    free(blk);
+                    return -NEWFS_ERROR_IO;
+                }
             }
-
-            dentry_cursor = dentry_cursor->brother;
-            offset += sizeof(struct newfs_dentry_d);
-            
         }
+        free(blk);
     }
-    else if (NEWFS_IS_REG(inode)) {                               // 如果是文件，直接将inode指向的数据逐块写入磁盘
-        while (i < NEWFS_DATA_PER_FILE && inode->block_pointer[i])
+    else if (NEWFS_IS_REG(inode) && inode->has_dirty_blks) {      // 如果是文件，只把修改过的数据块逐块异步写入磁盘
+        inode->wb_failed = FALSE;                                 // 脏标记等写全部完成后由newfs_sync_data_done清除
+        inode->wb_next   = super.wb_inodes;
+        super.wb_inodes  = inode;
+        for (i = 0; i < inode->blks_cap; i++)
         {
-            printf("write data idx:%d\n", inode->block_pointer[i]);
-            printf("wtire file back offset:%x\n", NEWFS_DATA_OFS(inode->block_pointer[i]));
-            if (newfs_driver_write(NEWFS_DATA_OFS(inode->block_pointer[i]), (inode->data) + i * NEWFS_BLK_SZ(),
-                                   NEWFS_BLK_SZ()) != NEWFS_ERROR_NONE)
+            if (!inode->dirty[i]) {
+                continue;
+            }
+            bno = newfs_bmap(inode, i, FALSE);
+            printf("write data idx:%d\n", bno);
+            printf("wtire file back offset:%x\n", NEWFS_DATA_OFS(bno));
+            newfs_cache_invalidate(NEWFS_DATA_OFS(bno), NEWFS_BLK_SZ());   // 整块覆盖，缓存中的旧副本作废
+            if (newfs_driver_write_async(NEWFS_DATA_OFS(bno), inode->data[i],
+                                   NEWFS_BLK_SZ(), inode) != NEWFS_ERROR_NONE)
             {
                 // SFS_DBG("[%s] io error\n", __func__);
+                inode->wb_failed = TRUE;                          // 后面的块还没提交
                 return -NEWFS_ERROR_IO;
             }
-            i++;
         }
     }
+    if (!NEWFS_IS_REG(inode) && inode->has_dirty_blks) {
+        memset(inode->dirty, 0, inode->blks_cap);
+        inode->has_dirty_blks = FALSE;
+    }
+    inode->is_dirty        = FALSE;
+    inode->has_dirty_child = FALSE;
     return NEWFS_ERROR_NONE;
 }
 
 /**
- * @brief 为一个inode分配dentry，采用头插法
+ * @brief 标记inode需要写回，并沿父目录向上标记子树中有修改；
+ * 祖先已标记时停止，因此标记的代价与新修改的路径长度成正比
+ * 
+ * @param inode 
+ */
+void newfs_dirty_inode(struct newfs_inode* inode) {
+    struct newfs_dentry* parent = inode->dentry->parent;
+    inode->is_dirty = TRUE;
+    while (parent && parent->inode && !parent->inode->has_dirty_child) {
+        parent->inode->has_dirty_child = TRUE;
+        parent = parent->parent;
+    }
+}
+
+/**
+ * @brief 标记文件内第blk块需要写回；还没有数据块的块在此预留一块，刷写时才真正分配
+ *
+ * @param inode
+ * @param blk 文件内块号
+ * @param force 空间不足时是否仍然预留
+ * @return int
+ */
+int newfs_dirty_blk(struct newfs_inode* inode, int blk, boolean force) {
+    if (newfs_inode_grow(inode, blk + 1) != NEWFS_ERROR_NONE) {
+        return -NEWFS_ERROR_NOSPACE;
+    }
+    if (inode->dirty[blk]) {                          /* 已预留或已有数据块 */
+        return NEWFS_ERROR_NONE;
+    }
+    if (newfs_bmap_reserve(inode, blk, force) != NEWFS_ERROR_NONE) {
+        return -NEWFS_ERROR_NOSPACE;
+    }
+    inode->dirty[blk]     = TRUE;
+    inode->has_dirty_blks = TRUE;
+    return NEWFS_ERROR_NONE;
+}
+
+/**
+ * @brief 标记文件一段数据所在的块需要写回
+ *
+ * @param inode 
+ * @param offset 文件内偏移
+ * @param size 
+ */
+void newfs_dirty_data(struct newfs_inode* inode, int offset, int size) {
+    int blk;
+    for (blk = offset / NEWFS_BLK_SZ(); size > 0 && blk <= (offset + size - 1) / NEWFS_BLK_SZ(); blk++) {
+        newfs_dirty_blk(inode, blk, TRUE);
+    }
+    newfs_dirty_inode(inode);
+}
+
+/**
+ * @brief 目录中从第from项开始的目录项位置有变化，标记它们所在的目录块需要写回
+ * 
+ * @param inode 目录的inode
+ * @param from 
+ */
+void newfs_dirty_dentrys(struct newfs_inode* inode, int from) {
+    int blk;
+    for (blk = from / NEWFS_DENTRY_PER_BLK(); 
+         from < (int)inode->dir_cnt && blk <= ((int)inode->dir_cnt - 1) / NEWFS_DENTRY_PER_BLK(); blk++) {
+        newfs_dirty_blk(inode, blk, TRUE);            /* 已加入的目录项不能丢，空间不足时留到刷写再报错 */
+    }
+    newfs_dirty_inode(inode);                         /* dir_cnt也变了 */
+}
+
+/**
+ * @brief 为一个inode分配dentry，采用尾插法，已有目录项在磁盘上的位置不变
  * 
  * @param inode 
  * @param dentry 
  * @return int 
  */
 int newfs_alloc_dentry(struct newfs_inode* inode, struct newfs_dentry* dentry) {
-    if (inode->dentrys == NULL) {
+    struct newfs_dentry* dentry_cursor = inode->dentrys;
+    if (dentry_cursor == NULL) {
         inode->dentrys = dentry;
     }
     else {
-        dentry->brother = inode->dentrys;
-        inode->dentrys = dentry;
+        while (dentry_cursor->brother) {
+            dentry_cursor = dentry_cursor->brother;
+        }
+        dentry_cursor->brother = dentry;
     }
     inode->dir_cnt++;
     return inode->dir_cnt;
 }
 
+/**
+ * @brief 读inode失败时释放已建立的部分：inode本身和已挂上的目录项
+ * 
+ * @param inode 
+ * @return struct newfs_inode* 总是NULL
+ */
+static struct newfs_inode* newfs_read_inode_fail(struct newfs_inode* inode) {
+    struct newfs_dentry* dentry_cursor = inode->dentrys;
+    struct newfs_dentry* dentry_to_free;
+    while (dentry_cursor) {
+        dentry_to_free = dentry_cursor;
+        dentry_cursor  = dentry_cursor->brother;
+        free(dentry_to_free);
+    }
+    free(inode);
+    return NULL;
+}
+
 /**
  * @brief 
  * 
  * @param dentry dentry指向ino，读取该inode
  * @param ino inode唯一编号
- * @return struct sfs_inode* 
+ * @return struct sfs_inode* 失败返回NULL
  */
 struct newfs_inode* newfs_read_inode(struct newfs_dentry * dentry, int ino) {
     printf("read ino:%d\n", ino);
@@ -261,79 +593,110 @@ struct newfs_inode* newfs_read_inode(struct newfs_dentry * dentry, int ino) {
     struct newfs_inode_d inode_d;
     struct newfs_dentry* sub_dentry;
     struct newfs_dentry_d dentry_d;
+    uint8_t* blk;
+    uint32_t bno;
     int    dir_cnt = 0, i;
     printf("read inode offset:%x\n", NEWFS_INO_OFS(ino));
-    // 通过磁盘驱动来将磁盘中ino号的inode读入内存
-    if (newfs_driver_read(NEWFS_INO_OFS(ino), (uint8_t *)&inode_d, 
-                        sizeof(struct newfs_inode_d)) != NEWFS_ERROR_NONE) {
+    // 从inode表中将磁盘中ino号的inode读入内存
+    if (inode == NULL) {
+        return NULL;
+    }
+    if (newfs_itable_read(ino, &inode_d) != NEWFS_ERROR_NONE) {
         // SFS_DBG("[%s] io error\n", __func__);
+        free(inode);
         return NULL;                    
     }
     inode->dir_cnt = 0;     // 先置为0，后面每分配一项就加一
+    inode->dentrys = NULL;
 
     inode->ino = inode_d.ino;
     inode->size = inode_d.size;
     memcpy(inode->target_path, inode_d.target_path, MAX_NAME_LEN);
     inode->dentry = dentry;
     inode->dentrys = NULL;
+    inode->data            = NULL;                    /* 文件数据按需读入 */
+    inode->dirty           = NULL;
+    inode->blks_cap        = 0;
+    inode->is_dirty        = FALSE;                     /* 与磁盘一致 */
+    inode->has_dirty_blks  = FALSE;
+    inode->resv_blks       = 0;
+    inode->has_dirty_child = FALSE;
     for (i = 0; i < NEWFS_DATA_PER_FILE; i++)
         inode->block_pointer[i] = inode_d.block_pointer[i];
+    inode->ind_pointer  = inode_d.ind_pointer;
+    inode->dind_pointer = inode_d.dind_pointer;
     printf("read ino_d:%d\n", inode_d.ino);
-    int k = 0; // k用于表示数据块号
     // 判断inode的文件类型，如果是目录类型则需要读取每一个目录项并建立连接
     if (NEWFS_IS_DIR(inode)) {
         dir_cnt = inode_d.dir_cnt;
         printf("read inode ,dir cnt:%d\n", dir_cnt);
-        int offset = NEWFS_DATA_OFS(inode->block_pointer[k]);
-        for (int i = 0; i < NEWFS_DATA_PER_FILE; i++)
-        {
-            printf("read inode dir data idx:%d\n", inode->block_pointer[i]);
+        if (dir_cnt > NEWFS_MAX_FILE_BLKS() * NEWFS_DENTRY_PER_BLK()) {
+            return newfs_read_inode_fail(inode);
         }
-
+        // 每个目录块只读一次，再从内存中解出其中所有目录项
+        blk = (uint8_t *)malloc(NEWFS_BLK_SZ());
         for (i = 0; i < dir_cnt; i++)
         {
-            // printf("offset before:%x\n", offset);
-            // printf("addr1:%lx\n", NEWFS_ROUND_DOWN((offset + sizeof(struct newfs_dentry_d)), NEWFS_BLK_SZ()));
-            // printf("addr2:%x\n", NEWFS_ROUND_DOWN(offset, NEWFS_BLK_SZ()));
-            if (NEWFS_ROUND_DOWN((offset + sizeof(struct newfs_dentry_d)), NEWFS_BLK_SZ()) > NEWFS_ROUND_DOWN(offset, NEWFS_BLK_SZ()))
-            {
-                if (++k >= NEWFS_DATA_PER_FILE) // 最多只能有6块
-                        return NEWFS_ERROR_UNSUPPORTED;
-                    offset = NEWFS_DATA_OFS(inode->block_pointer[k]);
-            }
-            // printf("read inode offset:%x\n", offset);
-            if (newfs_driver_read(offset,
-                                  (uint8_t *)&dentry_d,
-                                  sizeof(struct newfs_dentry_d)) != NEWFS_ERROR_NONE)
-            {
-                // SFS_DBG("[%s] io error\n", __func__);
-                return NULL;
+            if (i % NEWFS_DENTRY_PER_BLK() == 0) {
+                bno = newfs_bmap(inode, i / NEWFS_DENTRY_PER_BLK(), FALSE);
+                printf("read inode dir data idx:%d\n", bno);
+                if (bno == 0 || newfs_driver_read(NEWFS_DATA_OFS(bno),
+                                      blk, NEWFS_BLK_SZ()) != NEWFS_ERROR_NONE) {
+                    // SFS_DBG("[%s] io error\n", __func__);
+                    free(blk);
+                    return newfs_read_inode_fail(inode);
+                }
             }
-            // printf("dentry:%s\n", dentry_d.name);
-            offset += sizeof(struct newfs_dentry_d);
+            memcpy(&dentry_d, blk + (i % NEWFS_DENTRY_PER_BLK()) * sizeof(struct newfs_dentry_d),
+                   sizeof(struct newfs_dentry_d));
             sub_dentry = new_dentry(dentry_d.name, dentry_d.ftype);
             sub_dentry->parent = inode->dentry;
             sub_dentry->ino    = dentry_d.ino; 
             newfs_alloc_dentry(inode, sub_dentry);    // 将sub_dentry加入inode的目录项链表中
         }
-    }
-    // 如果是文件类型直接读取数据即可。
-    else if (NEWFS_IS_REG(inode)) {
-        inode->data = (uint8_t *)malloc(NEWFS_BLKS_SZ(NEWFS_DATA_PER_FILE));    // 这里是为数据在内存中分配空间
-        // inode->data = (uint8_t *)malloc(NEWFS_BLKS_SZ(NEWFS_DATA_PER_FILE)); 创建inode时已经开辟空间
-        while (k < NEWFS_DATA_PER_FILE && inode->block_pointer[k])
-        {
-            printf("read data idx:%d\n", inode->block_pointer[k]);
+        free(blk);
+        newfs_itable_readahead(inode);                // 子inode随后多半会被逐个stat
+    }    // 文件数据不在这里读取，由newfs_file_block在首次访问时逐块读入
+    return inode;
+}
 
-            if (newfs_driver_read(NEWFS_DATA_OFS(inode->block_pointer[k]), (inode->data)+k*NEWFS_BLK_SZ(), 
-                             NEWFS_BLK_SZ()) != NEWFS_ERROR_NONE) {
-            // SFS_DBG("[%s] io error\n", __func__);
-                return -NEWFS_ERROR_IO;
-            }
-            k++;
+/**
+ * @brief 取得文件第blk块的内存缓冲区，首次访问时才分配；
+ * fill为TRUE且该块在文件大小之内时从磁盘读入，否则清零
+ * 
+ * @param inode 
+ * @param blk 文件内块号
+ * @param fill 是否需要块的原有内容，整块覆盖写时为FALSE
+ * @return uint8_t* 失败返回NULL
+ */
+uint8_t* newfs_file_block(struct newfs_inode* inode, int blk, boolean fill) {
+    uint8_t* data;
+    uint32_t bno;
+    if (newfs_inode_grow(inode, blk + 1) != NEWFS_ERROR_NONE) {
+        return NULL;
+    }
+    data = inode->data[blk];
+    if (data) {
+        return data;
+    }
+    data = (uint8_t *)malloc(NEWFS_BLK_SZ());
+    if (data == NULL) {
+        return NULL;
+    }
+    bno = fill && blk * NEWFS_BLK_SZ() < inode->size ? newfs_bmap(inode, blk, FALSE) : 0;
+    if (bno) {                                        /* 未分配的块（空洞）读出来是0 */
+        printf("read data idx:%d\n", bno);
+        if (newfs_driver_read(NEWFS_DATA_OFS(bno), data, 
+                              NEWFS_BLK_SZ()) != NEWFS_ERROR_NONE) {
+            free(data);
+            return NULL;
         }
     }
-    return inode;
+    else {
+        memset(data, 0, NEWFS_BLK_SZ());
+    }
+    inode->data[blk] = data;
+    return data;
 }
 
 int newfs_calc_lvl(const char * path) {
@@ -371,7 +734,7 @@ char* newfs_get_fname(const char* path) {
  *      2) find qwe's dentry
  * 
  * @param path 
- * @return struct sfs_inode* 
+ * @return struct newfs_dentry* 读inode失败返回NULL
  */
 struct newfs_dentry* newfs_lookup(const char * path, boolean* is_find, boolean* is_root) {
     struct newfs_dentry *dentry_cursor = super.root_dentry;
@@ -381,7 +744,7 @@ struct newfs_dentry* newfs_lookup(const char * path, boolean* is_find, boolean*
     int   lvl = 0;
     boolean is_hit;
     char* fname = NULL;
-    char* path_cpy = (char*)malloc(sizeof(path));
+    char* path_cpy = (char*)malloc(strlen(path) + 1);
     *is_root = FALSE;
     // *is_find = FALSE;
     strcpy(path_cpy, path);
@@ -396,7 +759,11 @@ struct newfs_dentry* newfs_lookup(const char * path, boolean* is_find, boolean*
     {   
         lvl++;
         if (dentry_cursor->inode == NULL) {           /* Cache机制 */
-            newfs_read_inode(dentry_cursor, dentry_cursor->ino);
+            dentry_cursor->inode = newfs_read_inode(dentry_cursor, dentry_cursor->ino);
+            if (dentry_cursor->inode == NULL) {       /* 读inode失败 */
+                free(path_cpy);
+                return NULL;
+            }
         }
 
         inode = dentry_cursor->inode;
@@ -435,13 +802,37 @@ struct newfs_dentry* newfs_lookup(const char * path, boolean* is_find, boolean*
         fname = strtok(NULL, "/"); 
     }
 
+    free(path_cpy);
     if (dentry_ret->inode == NULL) {
         dentry_ret->inode = newfs_read_inode(dentry_ret, dentry_ret->ino);    // 找到后顺便把数据读取了
+        if (dentry_ret->inode == NULL) {
+            return NULL;
+        }
     }
     
     return dentry_ret;
 }
 
+/**
+ * @brief 挂载失败：释放已载入的位图和根目录项，销毁缓存并关闭驱动
+ * 
+ * @param root_dentry 
+ * @param ret 要返回的错误码
+ * @return int ret
+ */
+static int newfs_mount_fail(struct newfs_dentry* root_dentry, int ret) {
+    if (!super.is_map_in_place) {                     /* 原地映射的位图随驱动关闭解除 */
+        free(super.map_inode);
+        free(super.map_data);
+    }
+    super.map_inode = NULL;
+    super.map_data  = NULL;
+    free(root_dentry);
+    newfs_cache_destroy();
+    ddriver_close(super.fd);
+    return ret;
+}
+
 /**
  * @brief 挂载sfs, Layout 如下
  * 
@@ -470,6 +861,10 @@ int newfs_mount(struct custom_options options){
     boolean                 is_init = FALSE;
 
     super.is_mounted = FALSE;
+    super.is_map_dirty = FALSE;
+    super.is_map_in_place = FALSE;
+    super.map_inode = NULL;
+    super.map_data  = NULL;
     printf("\nmount\n");
     // 打开驱动
     // driver_fd = open(options.device, O_RDWR);
@@ -481,15 +876,19 @@ int newfs_mount(struct custom_options options){
     
     // 向内存超级块中标记驱动并写入磁盘大小和单次IO大小
     super.fd = driver_fd;
-    ddriver_ioctl(NEWFS_DRIVER(), IOC_REQ_DEVICE_SIZE,  &super.sz_disk);
+    ddriver_ioctl(NEWFS_DRIVER(), IOC_REQ_DEVICE_SIZE64, &super.sz_disk);
     ddriver_ioctl(NEWFS_DRIVER(), IOC_REQ_DEVICE_IO_SZ, &super.sz_io);
+    if (newfs_cache_init(options.cache_blks) != NEWFS_ERROR_NONE) {
+        ddriver_close(driver_fd);
+        return -NEWFS_ERROR_NOSPACE;
+    }
     
     // 创建根目录项 
     root_dentry = new_dentry("/", NEWFS_DIR);
     // 读取磁盘超级块
     if (newfs_driver_read(NEWFS_SUPER_OFS, (uint8_t *)(&newfs_super_d), 
                         sizeof(struct newfs_super_d)) != NEWFS_ERROR_NONE) {
-        return -NEWFS_ERROR_IO;
+        return newfs_mount_fail(root_dentry, -NEWFS_ERROR_IO);
     }
     // printf("aa\t");
     // printf("first time to open dick:");
@@ -505,6 +904,9 @@ int newfs_mount(struct custom_options options){
         // map_inode_blks = NEWFS_ROUND_UP(NEWFS_ROUND_UP(inode_num, UINT32_BITS), NEWFS_IO_SZ()) 
         //                  / NEWFS_BLK_SZ();
         map_inode_blks = 1; /*inode位图占用1个块*/
+        if (inode_num > NEWFS_BLKS_SZ(map_inode_blks) * UINT8_BITS) {    /* 大设备上受inode位图容量限制 */
+            inode_num = NEWFS_BLKS_SZ(map_inode_blks) * UINT8_BITS;
+        }
         // inode占的块数
         inode_blks = NEWFS_ROUND_UP(NEWFS_INODE_PER_FILE * inode_num, NEWFS_IO_SZ()) 
                          / NEWFS_BLK_SZ(); 
@@ -534,36 +936,42 @@ int newfs_mount(struct custom_options options){
     super.max_ino = newfs_super_d.max_ino;
 
     // 索引节点及索引节点位图部分
-    super.map_inode = (uint8_t *)malloc(NEWFS_BLKS_SZ(newfs_super_d.map_inode_blks));
     super.map_inode_blks = newfs_super_d.map_inode_blks;        // inode位图占用块数
     super.map_inode_offset = newfs_super_d.map_inode_offset;    // inode位图的地址
     super.inode_offset = newfs_super_d.inode_offset;            // inode的起始地址
-    // 读取inode位图
-    if (newfs_driver_read(newfs_super_d.map_inode_offset, (uint8_t *)(super.map_inode), 
-                        NEWFS_BLKS_SZ(newfs_super_d.map_inode_blks)) != NEWFS_ERROR_NONE) {
-        return -NEWFS_ERROR_IO;
+    // 读取inode位图（原地映射）
+    super.map_inode = newfs_load_bitmap(newfs_super_d.map_inode_offset, 
+                                        newfs_super_d.map_inode_blks);
+    if (super.map_inode == NULL) {
+        return newfs_mount_fail(root_dentry, -NEWFS_ERROR_IO);
     }
 
     // 数据块及数据块位图部分
-    super.map_data = (uint8_t *)malloc(NEWFS_BLKS_SZ(newfs_super_d.map_data_blks));
     super.map_data_blks = newfs_super_d.map_data_blks;          // 数据块位图占用块数
     super.map_data_offset = newfs_super_d.map_data_offset;      // 数据块位图的地址
     super.data_offset = newfs_super_d.data_offset;            // 数据块的起始地址
-    // 读取数据块位图
-    if (newfs_driver_read(newfs_super_d.map_data_offset, (uint8_t *)(super.map_data), 
-                        NEWFS_BLKS_SZ(newfs_super_d.map_data_blks)) != NEWFS_ERROR_NONE) {
-        return -NEWFS_ERROR_IO;
+    // 读取数据块位图（原地映射）
+    super.map_data = newfs_load_bitmap(newfs_super_d.map_data_offset, 
+                                       newfs_super_d.map_data_blks);
+    if (super.map_data == NULL) {
+        return newfs_mount_fail(root_dentry, -NEWFS_ERROR_IO);
     }
 
     // 初始化根目录项
     if (is_init) {                                    /* 分配根节点 */
+        super.map_data[0] |= 0x1;                     /* 数据块0保留，块号0表示未分配 */
+        super.is_map_dirty = TRUE;
         root_inode = newfs_alloc_inode(root_dentry, TRUE);    // 为根目录项创建inode节点，主要是为了标记位图
         newfs_sync_inode(root_inode);                   // 清空该inode节点
     }
     else{
         root_inode = newfs_read_inode(root_dentry, NEWFS_ROOT_INO);
+        if (root_inode == NULL) {                     /* 根目录读不出来，不能挂载 */
+            return newfs_mount_fail(root_dentry, -NEWFS_ERROR_IO);
+        }
     }
     root_dentry->inode    = root_inode;
+    newfs_bmap_init();                                /* 统计空闲数据块 */
     super.root_dentry = root_dentry;
     // printf("root_dentry_name:%s\n", root_dentry->name);
     // printf("io_size:%u\n",super.sz_io);
@@ -573,19 +981,31 @@ int newfs_mount(struct custom_options options){
     return ret;
 }
 /**
- * @brief 
+ * @brief 文件数据的异步写全部完成后调用：写成功的文件清除数据块的脏标记；
+ *        失败的保持脏，并重新沿父目录向上标记，下次刷写时重写
+ */
+static void newfs_sync_data_done() {
+    struct newfs_inode* inode;
+
+    while ((inode = super.wb_inodes) != NULL) {
+        super.wb_inodes = inode->wb_next;
+        if (inode->wb_failed) {
+            newfs_dirty_inode(inode);
+            continue;
+        }
+        memset(inode->dirty, 0, inode->blks_cap);
+        inode->has_dirty_blks = FALSE;
+    }
+}
+
+/**
+ * @brief 写回超级块、有修改的位图和缓存中的脏块
  * 
- * @return int 
+ * @return int
  */
-int newfs_umount() {
-    printf("\numount\n");
+static int newfs_sync_super() {
     struct newfs_super_d newfs_super_d;
 
-    if (!super.is_mounted) {
-        return NEWFS_ERROR_NONE;
-    }
-    // 回收（写回磁盘）
-    newfs_sync_inode(super.root_dentry->inode);     /* 从根节点向下刷写节点 */
     // 将内存超级块转化为磁盘超级块                                                
     newfs_super_d.magic_num           = NEWFS_MAGIC_NUM;    /*幻数，标志文件系统已初始化（格式化）*/
     newfs_super_d.max_ino             = super.max_ino;
@@ -602,24 +1022,85 @@ int newfs_umount() {
                      sizeof(struct newfs_super_d)) != NEWFS_ERROR_NONE) {
         return -NEWFS_ERROR_IO;
     }
-    // 写回inode位图到磁盘
-    if (newfs_driver_write(newfs_super_d.map_inode_offset, (uint8_t *)(super.map_inode), 
-                         NEWFS_BLKS_SZ(newfs_super_d.map_inode_blks)) != NEWFS_ERROR_NONE) {
-        return -NEWFS_ERROR_IO;
+    // 位图有修改时写回inode位图和数据块位图到磁盘
+    if (super.is_map_dirty) {
+        if (newfs_store_bitmap(super.map_inode, newfs_super_d.map_inode_offset, 
+                               newfs_super_d.map_inode_blks) != NEWFS_ERROR_NONE) {
+            return -NEWFS_ERROR_IO;
+        }
+        if (newfs_store_bitmap(super.map_data, newfs_super_d.map_data_offset, 
+                               newfs_super_d.map_data_blks) != NEWFS_ERROR_NONE) {
+            return -NEWFS_ERROR_IO;
+        }
+        super.is_map_dirty = FALSE;
     }
-    // 释放空间
-    free(super.map_inode);
+    // 缓存中的脏块按块号排序批量写回
+    return newfs_cache_flush();
+}
+
+/**
+ * @brief 把内存中的全部修改写回磁盘并落盘，文件系统保持挂载；后台刷写和卸载共用
+ * 
+ * @return int
+ */
+int newfs_sync_fs() {
+    int ret;
 
-    // 写回数据块位图到磁盘
-    if (newfs_driver_write(newfs_super_d.map_data_offset, (uint8_t *)(super.map_data), 
-                         NEWFS_BLKS_SZ(newfs_super_d.map_data_blks)) != NEWFS_ERROR_NONE) {
+    // 回收（写回磁盘）
+    ret = newfs_sync_inode(super.root_dentry->inode);   /* 从根节点向下刷写节点，没写回的保持脏 */
+    if (ret == NEWFS_ERROR_NONE) {
+        ret = newfs_sync_super();
+    }
+    // 无论成败都等文件数据的异步写完成：请求指向inode->data，放锁后可能被unlink释放
+    if (newfs_driver_drain() != NEWFS_ERROR_NONE && ret == NEWFS_ERROR_NONE) {
+        ret = -NEWFS_ERROR_IO;
+    }
+    newfs_sync_data_done();
+    if (ret != NEWFS_ERROR_NONE) {
+        return ret;
+    }
+    // 原地映射的位图统一msync
+    if (super.is_map_in_place && ddriver_flush_map(NEWFS_DRIVER()) < 0) {
         return -NEWFS_ERROR_IO;
     }
-    // 释放空间
-    free(super.map_data);
+    // 刷写屏障，之前写回的内容全部落盘
+    if (ddriver_ioctl(NEWFS_DRIVER(), IOC_REQ_DEVICE_FLUSH, NULL) < 0) {
+        return -NEWFS_ERROR_IO;
+    }
+    super.dirty_blks = 0;
+    return NEWFS_ERROR_NONE;
+}
+
+/**
+ * @brief 卸载：写回全部修改后释放位图和缓存，关闭驱动
+ * 
+ * @return int 
+ */
+int newfs_umount() {
+    int ret;
+
+    printf("\numount\n");
+
+    if (!super.is_mounted) {
+        return NEWFS_ERROR_NONE;
+    }
+    ret = newfs_sync_fs();
+    if (ret != NEWFS_ERROR_NONE) {
+        printf("umount: write back failed (%d)\n", ret);
+        return ret;
+    }
 
+    printf("cache: %lu hits, %lu misses, %lu evictions, %lu writebacks, %lu prefetched, %lu background flushes\n",
+           super.cache.hits, super.cache.misses, super.cache.evictions, super.cache.writebacks,
+           super.cache.prefetched, super.flushes);
+    if (!super.is_map_in_place) {
+        free(super.map_inode);
+        free(super.map_data);
+    }
+    newfs_cache_destroy();
     // 关闭驱动
     ddriver_close(NEWFS_DRIVER());
+    super.is_mounted = FALSE;
 
     return NEWFS_ERROR_NONE;
 }
@@ -691,7 +1172,16 @@ int newfs_drop_inode(struct newfs_inode * inode) {
         while (dentry_cursor)
         {   
             inode_cursor = dentry_cursor->inode;
-            newfs_drop_inode(inode_cursor);
+            if (inode_cursor == NULL) {               /* 尚未读入的子文件也要释放位图 */
+                inode_cursor = newfs_read_inode(dentry_cursor, dentry_cursor->ino);
+                if (inode_cursor == NULL) {
+                    return -NEWFS_ERROR_IO;
+                }
+                dentry_cursor->inode = inode_cursor;
+            }
+            if (newfs_drop_inode(inode_cursor) < 0) {
+                return -NEWFS_ERROR_IO;
+            }
             newfs_drop_dentry(inode, dentry_cursor);
             dentry_to_free = dentry_cursor;
             dentry_cursor = dentry_cursor->brother;
@@ -700,9 +1190,9 @@ int newfs_drop_inode(struct newfs_inode * inode) {
         /*删除完子文件夹的东西，再删除本文件夹*/ /*这里进行删文件夹的操作，实际上也就是再删一个文件*/
         inode->dentry->ftype = NEWFS_REG_FILE;
         newfs_drop_inode(inode);
-        newfs_drop_dentry(inode, inode->dentry);
     }
     else if (NEWFS_IS_REG(inode) || NEWFS_IS_SYM_LINK(inode)) {
+        super.is_map_dirty = TRUE;
         for (byte_cursor = 0; byte_cursor < NEWFS_BLKS_SZ(super.map_inode_blks); 
             byte_cursor++)                            /* 调整inodemap */
         {
@@ -720,37 +1210,12 @@ int newfs_drop_inode(struct newfs_inode * inode) {
                 break;
             }
         }
-        int data_cursor = 0;
-        int count = 0;
-        boolean finished = FALSE;
-        for (byte_cursor = 0; byte_cursor < NEWFS_BLKS_SZ(super.map_data_blks);
-             byte_cursor++) /* 调整datamap */
-        {
-            for (bit_cursor = 0; bit_cursor < UINT8_BITS; bit_cursor++) {
-                for (int i = 0; i < NEWFS_DATA_PER_FILE; i++)
-                {
-                    if (inode->block_pointer[i]==data_cursor)
-                    {
-                        printf("drop data_cursor:%d\n", data_cursor);
-                        super.map_data[byte_cursor] &= (uint8_t)(~(0x1 << bit_cursor));
-                        count++;
-                        if (count==6)
-                        {
-                            finished = TRUE;
-                            break;
-                        }
-                    }
-                }
-                data_cursor++;
-                if (finished == TRUE) 
-                    break;
-            }
-            if (finished == TRUE) {
-                break;
-            }
+        newfs_free_blocks(inode);                     /* 调整datamap并丢弃数据块 */
+        for (int i = 0; i < inode->blks_cap; i++) {
+            free(inode->data[i]);
         }
-        if (inode->data)
-            free(inode->data);
+        free(inode->data);
+        free(inode->dirty);
         free(inode);
     }
     return NEWFS_ERROR_NONE;
@@ -765,6 +1230,7 @@ int newfs_drop_inode(struct newfs_inode * inode) {
 int newfs_drop_dentry(struct newfs_inode * inode, struct newfs_dentry * dentry) {
     boolean is_find = FALSE;
     struct newfs_dentry* dentry_cursor;
+    int pos = 0;                                      /* 被删目录项的位置，其后的目录项前移 */
     dentry_cursor = inode->dentrys;
     
     if (dentry_cursor == dentry) {
@@ -774,6 +1240,7 @@ int newfs_drop_dentry(struct newfs_inode * inode, struct newfs_dentry * dentry)
     else {
         while (dentry_cursor)
         {
+            pos++;
             if (dentry_cursor->brother == dentry) {
                 dentry_cursor->brother = dentry->brother;
                 is_find = TRUE;
@@ -786,5 +1253,6 @@ int newfs_drop_dentry(struct newfs_inode * inode, struct newfs_dentry * dentry)
         return -NEWFS_ERROR_NOTFOUND;
     }
     inode->dir_cnt--;
+    newfs_dirty_dentrys(inode, pos);
     return inode->dir_cnt;
 }
\ No newline at end of file
@@ -44,6 +44,69 @@ function check_bm() {
     return 1
 }
 
+# 超过6个直接块和256个一次间接块，要用到二次间接块
+BIG_LINES=60000
+
+function remount () {
+    sleep 1
+    umount "${MNTPOINT}"
+    if check_mount; then
+        return 1
+    fi
+    try_mount_or_fail
+    return 0
+}
+
+function check_remount_big () {
+    _PARAM=$1
+    _TEST_CASE=$2
+    mkdir_and_check "${MNTPOINT}"/bigdir
+    for i in $(seq 1 "$_PARAM"); do
+        touch_and_check "${MNTPOINT}"/bigdir/file"$i"
+    done
+    seq 1 $BIG_LINES > "${MNTPOINT}"/bigdir/big0
+    if ! remount; then
+        fail "$_TEST_CASE: $PROJECT_NAME文件系统仍然在挂载点${MNTPOINT}"
+        return 1
+    fi
+    if [[ $(ls "${MNTPOINT}"/bigdir | wc -l) -ne $((_PARAM + 1)) ]]; then
+        fail "$_TEST_CASE: 重新挂载后目录${MNTPOINT}/bigdir中应该有$((_PARAM + 1))个目录项"
+        return 1
+    fi
+    if ! seq 1 $BIG_LINES | cmp -s - "${MNTPOINT}"/bigdir/big0; then
+        fail "$_TEST_CASE: 重新挂载后大文件${MNTPOINT}/bigdir/big0内容不同"
+        return 1
+    fi
+    return 0
+}
+
+function check_remount_full () {
+    _PARAM=$1
+    _TEST_CASE=$2
+    if dd if=/dev/zero of="${MNTPOINT}"/fill bs=1024 count=65536 2>/dev/null; then
+        fail "$_TEST_CASE: 写满磁盘时应该返回空间不足"
+        return 1
+    fi
+    if ! rm "${MNTPOINT}"/fill; then
+        fail "$_TEST_CASE: 删除文件${MNTPOINT}/fill失败"
+        return 1
+    fi
+    if ! remount; then
+        fail "$_TEST_CASE: $PROJECT_NAME文件系统仍然在挂载点${MNTPOINT}"
+        return 1
+    fi
+    if ! seq 1 $BIG_LINES | cmp -s - "${MNTPOINT}"/bigdir/big0; then
+        fail "$_TEST_CASE: 写满后重新挂载, 大文件${MNTPOINT}/bigdir/big0内容不同"
+        return 1
+    fi
+    # 释放的空间在重新挂载后可以再次使用
+    if ! seq 1 $BIG_LINES > "${MNTPOINT}"/big1 || ! seq 1 $BIG_LINES | cmp -s - "${MNTPOINT}"/big1; then
+        fail "$_TEST_CASE: 写满后重新挂载, 写入文件${MNTPOINT}/big1失败"
+        return 1
+    fi
+    return 0
+}
+
 clean_mount
 clean_ddriver
 
@@ -55,4 +118,12 @@ TEST_CASE="case 5.1 - umount ${MNTPOINT}"
 core_tester ls "${MNTPOINT}" check_umount "$TEST_CASE"
 
 TEST_CASE="case 5.2 - check bitmap"
-core_tester ls "${MNTPOINT}" check_bm "$TEST_CASE" 15
\ No newline at end of file
+core_tester ls "${MNTPOINT}" check_bm "$TEST_CASE" 15
+
+try_mount_or_fail
+
+TEST_CASE="case 5.3 - remount with big file and 100 files in ${MNTPOINT}/bigdir"
+core_tester echo 100 check_remount_big "$TEST_CASE"
+
+TEST_CASE="case 5.4 - fill ${MNTPOINT} to ENOSPC and remount"
+core_tester echo "$TEST_CASE" check_remount_full "$TEST_CASE"
@@ -31,6 +31,58 @@ function check_read () {
     return 0
 }
 
+# 超过6个直接块和256个一次间接块，要用到二次间接块
+BIG_LINES=60000
+
+function check_big_file () {
+    _PARAM=$1
+    _TEST_CASE=$2
+    if ! seq 1 $BIG_LINES > "${MNTPOINT}"/big0; then
+        fail "$_TEST_CASE: 写入大文件${MNTPOINT}/big0失败"
+        return 1
+    fi
+    if ! seq 1 $BIG_LINES | cmp -s - "${MNTPOINT}"/big0; then
+        fail "$_TEST_CASE: 读大文件${MNTPOINT}/big0成功, 但内容不同, 正确的内容为seq 1 $BIG_LINES的输出"
+        return 1
+    fi
+    return 0
+}
+
+function check_big_dir () {
+    _PARAM=$1
+    _TEST_CASE=$2
+    mkdir_and_check "${MNTPOINT}"/bigdir
+    for i in $(seq 1 "$_PARAM"); do
+        if ! touch "${MNTPOINT}"/bigdir/file"$i"; then
+            fail "$_TEST_CASE: 在目录${MNTPOINT}/bigdir中创建第$i个文件失败"
+            return 1
+        fi
+    done
+    if [[ $(ls "${MNTPOINT}"/bigdir | wc -l) -ne $_PARAM ]]; then
+        fail "$_TEST_CASE: 目录${MNTPOINT}/bigdir中应该有$_PARAM个目录项"
+        return 1
+    fi
+    return 0
+}
+
+function check_unlink_reuse () {
+    _PARAM=$1
+    _TEST_CASE=$2
+    if ! rm "${MNTPOINT}"/big0 || [ -e "${MNTPOINT}"/big0 ]; then
+        fail "$_TEST_CASE: 删除文件${MNTPOINT}/big0失败"
+        return 1
+    fi
+    # 同名文件重新创建，复用刚释放的inode和数据块
+    if ! check_big_file "$_PARAM" "$_TEST_CASE"; then
+        return 1
+    fi
+    if ! seq 1 $BIG_LINES > "${MNTPOINT}"/big1 || ! seq 1 $BIG_LINES | cmp -s - "${MNTPOINT}"/big1; then
+        fail "$_TEST_CASE: 删除后再写入文件${MNTPOINT}/big1, 内容不同"
+        return 1
+    fi
+    return 0
+}
+
 
 try_mount_or_fail
 
@@ -39,4 +91,13 @@ touch_and_check "${MNTPOINT}"/file0
 core_tester echo "$GOLDEN" check_write "$TEST_CASE"
 
 TEST_CASE="case 6.2 - read ${MNTPOINT}/file0"
-core_tester echo "$GOLDEN" check_read "$TEST_CASE"
\ No newline at end of file
+core_tester echo "$GOLDEN" check_read "$TEST_CASE"
+
+TEST_CASE="case 6.3 - write and read big file ${MNTPOINT}/big0"
+core_tester echo "$TEST_CASE" check_big_file "$TEST_CASE"
+
+TEST_CASE="case 6.4 - create 100 files in ${MNTPOINT}/bigdir"
+core_tester echo 100 check_big_dir "$TEST_CASE"
+
+TEST_CASE="case 6.5 - unlink ${MNTPOINT}/big0 and write again"
+core_tester echo "$TEST_CASE" check_unlink_reuse "$TEST_CASE"
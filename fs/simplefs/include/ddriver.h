@@ -4,10 +4,39 @@
 #include "ddriver_ctl_user.h"
 #include "stdio.h"
 
+#define DDRIVER_OP_READ         0
+#define DDRIVER_OP_WRITE        1
+
+#define DDRIVER_REQ_FUA         (1 << 0)
+#define DDRIVER_REQ_PREFLUSH    (1 << 1)
+
+struct ddriver_req
+{
+    int                 op;         /* DDRIVER_OP_READ / DDRIVER_OP_WRITE */
+    int                 flags;
+    char               *buf;
+    size_t              size;       /* IO单位的整数倍 */
+    off_t               offset;     /* 与IO单位对齐 */
+    int                 res;        /* 完成后的返回值，字节数或负错误码 */
+    void               *priv;       /* 调用者私有数据 */
+    long                stamp;      /* 驱动内部使用：提交时刻(us) */
+    struct ddriver_req *next;       /* 驱动内部使用 */
+};
+
 int ddriver_open(char *path);
-int ddriver_seek(int fd, off_t offset, int whence);
+off_t ddriver_seek(int fd, off_t offset, int whence);
 int ddriver_write(int fd, char *buf, size_t size);
 int ddriver_read(int fd, char *buf, size_t size);
+int ddriver_writev(int fd, char *buf, size_t size);
+int ddriver_readv(int fd, char *buf, size_t size);
+int ddriver_pwrite(int fd, char *buf, size_t size, off_t offset);
+int ddriver_pwrite_flags(int fd, char *buf, size_t size, off_t offset, int flags);
+int ddriver_pread(int fd, char *buf, size_t size, off_t offset);
+int ddriver_submit(int fd, struct ddriver_req **reqs, int nr);
+int ddriver_getevents(int fd, int min_nr, int max_nr, struct ddriver_req **events);
+char *ddriver_map_block(int fd, int blkno);
+int ddriver_dirty_block(int fd, int blkno);
+int ddriver_flush_map(int fd);
 int ddriver_ioctl(int fd, unsigned long cmd, void *ret);
 int ddriver_close(int fd);
 
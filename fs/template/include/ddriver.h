@@ -4,6 +4,25 @@
 #include "ddriver_ctl_user.h"
 #include "stdio.h"
 
+#define DDRIVER_OP_READ         0
+#define DDRIVER_OP_WRITE        1
+
+#define DDRIVER_REQ_FUA         (1 << 0)    /* 写完成即落盘 */
+#define DDRIVER_REQ_PREFLUSH    (1 << 1)    /* 写之前先刷写 */
+
+struct ddriver_req
+{
+    int                 op;         /* DDRIVER_OP_READ / DDRIVER_OP_WRITE */
+    int                 flags;      /* DDRIVER_REQ_* */
+    char               *buf;
+    size_t              size;       /* IO单位的整数倍 */
+    off_t               offset;     /* 与IO单位对齐 */
+    int                 res;        /* 完成后的返回值，字节数或负错误码 */
+    void               *priv;       /* 调用者私有数据 */
+    long                stamp;      /* 驱动内部使用：提交时刻(us) */
+    struct ddriver_req *next;       /* 驱动内部使用 */
+};
+
 /**
  * @brief 打开ddriver设备
  * 
@@ -18,9 +37,9 @@ int ddriver_open(char *path);
  * @param fd ddriver设备handler
  * @param offset 移动到的位置，注意要和设备IO单位对齐
  * @param whence SEEK_SET即可
- * @return int 0成功，否则失败
+ * @return off_t 移动后的位置，小于0失败
  */
-int ddriver_seek(int fd, off_t offset, int whence);
+off_t ddriver_seek(int fd, off_t offset, int whence);
 
 /**
  * @brief 写入数据
@@ -42,6 +61,107 @@ int ddriver_write(int fd, char *buf, size_t size);
  */
 int ddriver_read(int fd, char *buf, size_t size);
 
+/**
+ * @brief 连续写入多个IO单位，整个请求只计一次设备延迟
+ * 
+ * @param fd ddriver设备handler
+ * @param buf 要写入的数据Buf
+ * @param size 要写入的数据大小，注意一定要是设备IO单位的整数倍
+ * @return int 写入的字节数，小于0失败
+ */
+int ddriver_writev(int fd, char *buf, size_t size);
+
+/**
+ * @brief 连续读出多个IO单位，整个请求只计一次设备延迟
+ * 
+ * @param fd ddriver设备handler
+ * @param buf 要读出的数据Buf
+ * @param size 要读出的数据大小，注意一定要是设备IO单位的整数倍
+ * @return int 读出的字节数，小于0失败
+ */
+int ddriver_readv(int fd, char *buf, size_t size);
+
+/**
+ * @brief 在指定位置写入数据，无需先调用ddriver_seek
+ * 
+ * @param fd ddriver设备handler
+ * @param buf 要写入的数据Buf
+ * @param size 要写入的数据大小，注意一定要是设备IO单位的整数倍
+ * @param offset 写入位置，注意要和设备IO单位对齐
+ * @return int 写入的字节数，小于0失败
+ */
+int ddriver_pwrite(int fd, char *buf, size_t size, off_t offset);
+
+/**
+ * @brief 带标志的定位写，flags为DDRIVER_REQ_FUA/DDRIVER_REQ_PREFLUSH的组合
+ * 
+ * @param fd ddriver设备handler
+ * @param buf 要写入的数据Buf
+ * @param size 要写入的数据大小，注意一定要是设备IO单位的整数倍
+ * @param offset 写入位置，注意要和设备IO单位对齐
+ * @param flags DDRIVER_REQ_*
+ * @return int 写入的字节数，小于0失败
+ */
+int ddriver_pwrite_flags(int fd, char *buf, size_t size, off_t offset, int flags);
+
+/**
+ * @brief 从指定位置读出数据，无需先调用ddriver_seek
+ * 
+ * @param fd ddriver设备handler
+ * @param buf 要读出的数据Buf
+ * @param size 要读出的数据大小，注意一定要是设备IO单位的整数倍
+ * @param offset 读出位置，注意要和设备IO单位对齐
+ * @return int 读出的字节数，小于0失败
+ */
+int ddriver_pread(int fd, char *buf, size_t size, off_t offset);
+
+/**
+ * @brief 批量提交异步读写请求，立即返回
+ * 
+ * @param fd ddriver设备handler
+ * @param reqs 请求数组，被收割之前请求本身及其buf都不能释放
+ * @param nr 请求个数
+ * @return int 提交的请求数，小于0失败
+ */
+int ddriver_submit(int fd, struct ddriver_req **reqs, int nr);
+
+/**
+ * @brief 收割已完成的异步请求
+ * 
+ * @param fd ddriver设备handler
+ * @param min_nr 至少等待完成的请求数，0表示只轮询
+ * @param max_nr 最多收割的请求数
+ * @param events 输出已完成的请求，结果见req->res
+ * @return int 收割的请求数
+ */
+int ddriver_getevents(int fd, int min_nr, int max_nr, struct ddriver_req **events);
+
+/**
+ * @brief 获取IO单位在设备镜像映射中的地址，可原地读写，无需拷贝
+ * 
+ * @param fd ddriver设备handler
+ * @param blkno IO单位编号，映射连续，可访问其后的多个IO单位
+ * @return char* 映射地址，NULL失败
+ */
+char *ddriver_map_block(int fd, int blkno);
+
+/**
+ * @brief 标记映射中的IO单位已被修改
+ * 
+ * @param fd ddriver设备handler
+ * @param blkno IO单位编号
+ * @return int 0成功，否则失败
+ */
+int ddriver_dirty_block(int fd, int blkno);
+
+/**
+ * @brief 将映射中被标记的IO单位写回设备(msync)
+ * 
+ * @param fd ddriver设备handler
+ * @return int 0成功，否则失败
+ */
+int ddriver_flush_map(int fd);
+
 /**
  * @brief ddriver IO控制
  * 
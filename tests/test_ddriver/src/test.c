@@ -1,11 +1,41 @@
 #include "../include/ddriver.h"
 #include <linux/fs.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+
+struct thread_arg {
+    int fd;
+    int id;
+    int ok;
+};
+
+static void *io_thread(void *arg) {                 // 每个线程读写自己的区间
+    struct thread_arg *targ = arg;
+    char wbuf[512 * 4], rbuf[512 * 4];
+    off_t offset = 512 * (64 + targ->id * 4);
+
+    targ->ok = 1;
+    for (int round = 0; round < 8; round++) {
+        memset(wbuf, 'A' + targ->id * 8 + round, sizeof(wbuf));
+        ddriver_pwrite(targ->fd, wbuf, sizeof(wbuf), offset);
+        ddriver_pread(targ->fd, rbuf, sizeof(rbuf), offset);
+        if (memcmp(wbuf, rbuf, sizeof(wbuf)) != 0)
+            targ->ok = 0;
+    }
+    return NULL;
+}
 
 int main(int argc, char const *argv[])
 {
     int size;
     struct ddriver_state state;
-    int fd = ddriver_open("/home/students/200110515/ddriver");   // 打开ddriver设备,应该是绝对路径？
+    char path[256];
+    snprintf(path, sizeof(path), "%s/ddriver", getenv("HOME"));
+    int fd = ddriver_open(path);                    // 打开ddriver设备，镜像可以是任意路径
     if (fd < 0) {
         return -1;
     }
@@ -42,6 +72,326 @@ int main(int argc, char const *argv[])
     printf("write_cnt: %d\n", state.write_cnt);
     printf("seek_cnt: %d\n", state.seek_cnt);
 
+    /* Cycle 5: multi-unit read/write test */
+    char vbuffer[512 * 4];
+    char vrbuffer[512 * 4];
+    memset(vbuffer, 'b', sizeof(vbuffer));
+    ddriver_seek(fd, 0, SEEK_SET);
+    ddriver_writev(fd, vbuffer, sizeof(vbuffer));   // 一次写入4个IO单位
+    ddriver_seek(fd, 0, SEEK_SET);
+    ddriver_readv(fd, vrbuffer, sizeof(vrbuffer));  // 一次读出4个IO单位
+    if (memcmp(vbuffer, vrbuffer, sizeof(vbuffer)) != 0) {
+        printf("readv/writev mismatch\n");
+        return -1;
+    }
+
+    /* Cycle 6: positional read/write test */
+    ddriver_pwrite(fd, vbuffer, 512, 512 * 8);      // 无需SEEK，直接写入第8个IO单位
+    ddriver_pread(fd, vrbuffer, 512, 512 * 8);
+    if (memcmp(vbuffer, vrbuffer, 512) != 0) {
+        printf("pread/pwrite mismatch\n");
+        return -1;
+    }
+
+    /* Cycle 7: async submit/getevents test */
+    struct ddriver_req reqs[4];
+    struct ddriver_req *preqs[4];
+    for (int i = 0; i < 4; i++) {
+        reqs[i].op     = DDRIVER_OP_WRITE;
+        reqs[i].flags  = 0;
+        reqs[i].buf    = vbuffer + i * 512;
+        reqs[i].size   = 512;
+        reqs[i].offset = 512 * (16 + i);
+        preqs[i]       = &reqs[i];
+    }
+    ddriver_submit(fd, preqs, 4);                   // 一次提交4个写请求
+    int done = 0;
+    while (done < 4) {
+        done += ddriver_getevents(fd, 1, 4, preqs);  // 至少等待1个完成
+    }
+    ddriver_pread(fd, vrbuffer, 512 * 4, 512 * 16);
+    if (memcmp(vbuffer, vrbuffer, 512 * 4) != 0) {
+        printf("async write mismatch\n");
+        return -1;
+    }
+
+    /* Cycle 8: mmap test */
+    char *blk = ddriver_map_block(fd, 16);         // 原地访问第16个IO单位
+    if (blk == NULL || memcmp(blk, vbuffer, 512) != 0) {
+        printf("map block mismatch\n");
+        return -1;
+    }
+    blk[0] = 'c';
+    ddriver_dirty_block(fd, 16);
+    ddriver_flush_map(fd);
+
+    /* Cycle 9: io scheduler test */
+    struct ddriver_sched sched;
+    ddriver_ioctl(fd, IOC_REQ_DEVICE_GET_SCHED, &sched);
+    sched.type = DDRIVER_SCHED_ELEVATOR;
+    ddriver_ioctl(fd, IOC_REQ_DEVICE_SCHED, &sched);   // 按偏移服务并合并相邻请求
+    for (int i = 0; i < 4; i++) {
+        reqs[i].op     = DDRIVER_OP_WRITE;
+        reqs[i].flags  = 0;
+        reqs[i].buf    = vbuffer + (3 - i) * 512;
+        reqs[i].size   = 512;
+        reqs[i].offset = 512 * (27 - i);              // 逆序提交
+        preqs[i]       = &reqs[i];
+    }
+    ddriver_submit(fd, preqs, 4);
+    done = 0;
+    while (done < 4) {
+        done += ddriver_getevents(fd, 1, 4, preqs);
+    }
+    for (int i = 0; i < 4; i++) {
+        if (preqs[i]->res != 512) {
+            printf("sched write failed\n");
+            return -1;
+        }
+    }
+    ddriver_pread(fd, vrbuffer, 512 * 4, 512 * 24);
+    if (memcmp(vbuffer, vrbuffer, 512 * 4) != 0) {
+        printf("sched write mismatch\n");
+        return -1;
+    }
+
+    /* Cycle 10: 64-bit stats test */
+    struct ddriver_stats stats;
+    stats.size = sizeof(stats);
+    ddriver_ioctl(fd, IOC_REQ_DEVICE_STATS_RESET, &stats);   // 取快照并清零
+    ddriver_pwrite(fd, vbuffer, 512 * 2, 512 * 32);
+    ddriver_pread(fd, vrbuffer, 512, 512 * 8);
+    stats.size = sizeof(stats);
+    ddriver_ioctl(fd, IOC_REQ_DEVICE_STATS, &stats);
+    if (stats.version != DDRIVER_STATS_VERSION || stats.write_cnt != 1 || 
+        stats.write_bytes != 512 * 2 || stats.read_cnt != 1 || stats.read_bytes != 512) {
+        printf("stats mismatch\n");
+        return -1;
+    }
+    printf("seek_cnt: %llu seek_dist: %llu lat: %llu us\n", 
+           (unsigned long long)stats.seek_cnt, (unsigned long long)stats.seek_dist,
+           (unsigned long long)(stats.read_lat_us + stats.write_lat_us));
+
+    /* Cycle 11: multi-instance test */
+    char path2[sizeof(path) + 16];                  // 留出".2_log"等后缀的空间
+    snprintf(path2, sizeof(path2), "%s.2", path);
+    int fd2 = ddriver_open(path2);                  // 第二个设备，状态与第一个互相独立
+    if (fd2 < 0 || ddriver_open(path) >= 0) {       // 同一镜像不能打开两次
+        printf("multi-instance open failed\n");
+        return -1;
+    }
+    memset(vbuffer, 'd', sizeof(vbuffer));
+    ddriver_pwrite(fd2, vbuffer, 512, 0);
+    ddriver_pread(fd, vrbuffer, 512, 0);
+    if (memcmp(vbuffer, vrbuffer, 512) == 0) {
+        printf("devices share data\n");
+        return -1;
+    }
+    stats.size = sizeof(stats);
+    ddriver_ioctl(fd2, IOC_REQ_DEVICE_STATS, &stats);
+    if (stats.write_cnt != 1 || stats.read_cnt != 0) {
+        printf("devices share stats\n");
+        return -1;
+    }
+    ddriver_close(fd2);
+    unlink(path2);
+    snprintf(path2, sizeof(path2), "%s.2_log", path);
+    unlink(path2);
+
+    /* Cycle 12: multi-thread test */
+    pthread_t tids[4];
+    struct thread_arg targs[4];
+    int parallel = 4;
+    ddriver_ioctl(fd, IOC_REQ_DEVICE_PARALLEL, &parallel);   // 不重叠的请求并行服务
+    for (int i = 0; i < 4; i++) {
+        targs[i].fd = fd;
+        targs[i].id = i;
+        pthread_create(&tids[i], NULL, io_thread, &targs[i]);
+    }
+    for (int i = 0; i < 4; i++) {
+        pthread_join(tids[i], NULL);
+        if (!targs[i].ok) {
+            printf("multi-thread mismatch\n");
+            return -1;
+        }
+    }
+
+    /* Cycle 13: discard test */
+    struct ddriver_discard discard = { .offset = 512 * 64, .len = 512 * 4 };
+    ddriver_ioctl(fd, IOC_REQ_DEVICE_DISCARD, &discard);   // 丢弃多线程测试写过的区间
+    ddriver_pread(fd, vrbuffer, 512 * 4, 512 * 64);
+    memset(vbuffer, 0, sizeof(vbuffer));
+    if (memcmp(vbuffer, vrbuffer, 512 * 4) != 0) {
+        printf("discard not zeroed\n");
+        return -1;
+    }
+
+    /* Cycle 14: flush / FUA test */
+    int mode = DDRIVER_FLUSH_FDATASYNC;
+    ddriver_ioctl(fd, IOC_REQ_DEVICE_FLUSH_MODE, &mode);       // 真正落盘
+    stats.size = sizeof(stats);
+    ddriver_ioctl(fd, IOC_REQ_DEVICE_STATS_RESET, &stats);
+    ddriver_pwrite_flags(fd, vbuffer, 512, 512 * 40, DDRIVER_REQ_PREFLUSH | DDRIVER_REQ_FUA);
+    ddriver_ioctl(fd, IOC_REQ_DEVICE_FLUSH, NULL);
+    stats.size = sizeof(stats);
+    ddriver_ioctl(fd, IOC_REQ_DEVICE_STATS, &stats);
+    if (stats.flush_cnt != 2 || stats.fua_cnt != 1) {
+        printf("flush stats mismatch\n");
+        return -1;
+    }
+    printf("flush_cnt: %llu flush_us: %llu\n", 
+           (unsigned long long)stats.flush_cnt, (unsigned long long)stats.flush_us);
+
+    ddriver_close(fd);
+
+    /* Cycle 15: trace test */
+    char trace_path[sizeof(path) + 16];
+    unsigned int trace_hdr[4];                      // magic, version, io_sz, rec_size
+    snprintf(path2, sizeof(path2), "%s.3", path);
+    snprintf(trace_path, sizeof(trace_path), "%s.3_trace", path);
+    setenv("DDRIVER_TRACE", "1", 1);
+    fd2 = ddriver_open(path2);
+    unsetenv("DDRIVER_TRACE");
+    ddriver_pwrite(fd2, vbuffer, 512, 512 * 8);
+    ddriver_seek(fd2, 0, SEEK_SET);
+    ddriver_close(fd2);
+    FILE *trace = fopen(trace_path, "r");
+    if (trace == NULL || fread(trace_hdr, sizeof(trace_hdr), 1, trace) != 1 ||
+        memcmp(trace_hdr, "DDRT", 4) != 0) {
+        printf("trace header missing\n");
+        return -1;
+    }
+    fseek(trace, 0, SEEK_END);
+    if (ftell(trace) != 24 + 2 * trace_hdr[3]) {    // 文件头24字节 + 一次写一次SEEK
+        printf("trace records mismatch\n");
+        return -1;
+    }
+    fclose(trace);
+    unlink(trace_path);
+    unlink(path2);
+    snprintf(path2, sizeof(path2), "%s.3_log", path);
+    unlink(path2);
+
+    /* Cycle 16: virtual clock test */
+    uint64_t dev_time;
+    struct timespec begin, end;
+    int clock_mode = DDRIVER_CLOCK_VIRTUAL;
+    fd = ddriver_open(path);
+    ddriver_ioctl(fd, IOC_REQ_DEVICE_CLOCK, &clock_mode);      // 不睡眠，只推进模拟时钟
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    for (int i = 0; i < 64; i++)
+        ddriver_pwrite(fd, vbuffer, 512, 512 * (i * 97 % 1024));
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ddriver_ioctl(fd, IOC_REQ_DEVICE_TIME, &dev_time);
+    if (dev_time < 64 * 1000 || end.tv_sec - begin.tv_sec > 1) {   // 每次写至少1ms，但不真睡
+        printf("virtual clock mismatch\n");
+        return -1;
+    }
+    printf("device time: %llu us\n", (unsigned long long)dev_time);
+
+    /* Cycle 17: device cache test */
+    struct ddriver_cache cache = { .size = 64 * 1024, .policy = DDRIVER_DESTAGE_LAZY,
+                                   .write_lat_us = 10, .read_lat_us = 10, .idle_us = 0 };
+    ddriver_ioctl(fd, IOC_REQ_DEVICE_CACHE, &cache);           // 写先进入设备缓存
+    stats.size = sizeof(stats);
+    ddriver_ioctl(fd, IOC_REQ_DEVICE_STATS_RESET, &stats);
+    ddriver_pwrite(fd, vbuffer, 512 * 4, 512 * 128);
+    ddriver_pread(fd, vrbuffer, 512 * 4, 512 * 128);           // 命中缓存
+    ddriver_ioctl(fd, IOC_REQ_DEVICE_TIME, &dev_time);
+    stats.size = sizeof(stats);
+    ddriver_ioctl(fd, IOC_REQ_DEVICE_STATS, &stats);
+    if (stats.cache_writes != 1 || stats.cache_read_hits != 1 ||
+        stats.cache_dirty_bytes != 512 * 4 || dev_time >= 1000) {
+        printf("device cache mismatch\n");
+        return -1;
+    }
+    ddriver_ioctl(fd, IOC_REQ_DEVICE_FLUSH, NULL);             // 刷写屏障等待写回
+    stats.size = sizeof(stats);
+    ddriver_ioctl(fd, IOC_REQ_DEVICE_STATS, &stats);
+    if (stats.cache_dirty_bytes != 0 || stats.destage_cnt != 1 ||
+        stats.destage_bytes != 512 * 4) {
+        printf("destage mismatch\n");
+        return -1;
+    }
+
+    /* Cycle 18: snapshot / clone test */
+    struct ddriver_snapshot snap;
+    if (snprintf(snap.path, sizeof(snap.path), "%s.snap", path) >= (int)sizeof(snap.path)) {
+        printf("snapshot path too long\n");                    // 快照路径长度受ioctl结构限制
+        return -1;
+    }
+    memset(vbuffer, 's', sizeof(vbuffer));
+    ddriver_pwrite(fd, vbuffer, 512, 512 * 200);
+    if (ddriver_ioctl(fd, IOC_REQ_DEVICE_SNAPSHOT, &snap) < 0) {   // 保存只读快照
+        printf("snapshot failed\n");
+        return -1;
+    }
+    memset(vbuffer, 't', sizeof(vbuffer));
+    ddriver_pwrite(fd, vbuffer, 512, 512 * 200);                // 之后的写不影响快照
+    snprintf(path2, sizeof(path2), "%s.4", path);
+    fd2 = ddriver_open(path2);
+    if (ddriver_ioctl(fd2, IOC_REQ_DEVICE_CLONE, &snap) < 0) {
+        printf("clone failed\n");
+        return -1;
+    }
+    ddriver_pwrite(fd2, vbuffer, 512, 512 * 201);               // 改写的IO单位写入克隆自己的镜像
+    ddriver_close(fd2);
+    fd2 = ddriver_open(path2);                                  // 重新打开仍是同一快照的克隆
+    ddriver_pread(fd2, vrbuffer, 512 * 2, 512 * 200);
+    if (vrbuffer[0] != 's' || vrbuffer[512] != 't') {
+        printf("clone mismatch\n");
+        return -1;
+    }
+    ddriver_close(fd2);
+    unlink(path2);
+    unlink(snap.path);
+    snprintf(path2, sizeof(path2), "%s.4_log", path);
+    unlink(path2);
+    snprintf(path2, sizeof(path2), "%s.4_cow", path);
+    unlink(path2);
+
+    /* Cycle 19: scheduler order under hdd model test */
+    struct ddriver_model model = { .type = DDRIVER_MODEL_HDD, .read_lat_us = 100, .write_lat_us = 100,
+                                   .seek_min_us = 500, .seek_max_us = 15000, .rpm = 7200 };
+    struct ddriver_req sreqs[64];
+    struct ddriver_req *psreqs[64];
+    parallel = 1;
+    cache.size = 0;
+    ddriver_ioctl(fd, IOC_REQ_DEVICE_CACHE, &cache);           // 写直接落到介质，移动磁盘头
+    ddriver_ioctl(fd, IOC_REQ_DEVICE_MODEL, &model);
+    ddriver_ioctl(fd, IOC_REQ_DEVICE_PARALLEL, &parallel);
+    ddriver_ioctl(fd, IOC_REQ_DEVICE_SCHED, &sched);            // 仍是Cycle 9设置的电梯
+    ddriver_pwrite(fd, vbuffer, 512, 0);                        // 磁盘头停在512
+    stats.size = sizeof(stats);
+    ddriver_ioctl(fd, IOC_REQ_DEVICE_STATS_RESET, &stats);
+    for (int i = 0; i < 64; i++) {
+        sreqs[i].op     = DDRIVER_OP_WRITE;
+        sreqs[i].flags  = 0;
+        sreqs[i].buf    = vbuffer;
+        sreqs[i].size   = 512;
+        sreqs[i].offset = 512 * (2 + 2 * (i * 37 % 64));        // 打乱且互不相邻，不会合并
+        psreqs[i]       = &sreqs[i];
+    }
+    ddriver_submit(fd, psreqs, 64);
+    done = 0;
+    while (done < 64) {
+        done += ddriver_getevents(fd, 1, 64, psreqs);
+    }
+    stats.size = sizeof(stats);
+    ddriver_ioctl(fd, IOC_REQ_DEVICE_STATS, &stats);
+    if (stats.seek_dist != 64 * 512) {                          // 按偏移升序服务，每次只跳过一个IO单位
+        printf("sched order mismatch, seek_dist: %llu\n", (unsigned long long)stats.seek_dist);
+        return -1;
+    }
+
+    /* Cycle 20: device end check test */
+    ddriver_ioctl(fd, IOC_REQ_DEVICE_SIZE, &size);
+    if (ddriver_pwrite(fd, vbuffer, 512 * 2, size - 512) != -EINVAL ||   // 从最后一个IO单位起写两个
+        ddriver_pread(fd, vrbuffer, 512 * 2, size - 512) != -EINVAL ||
+        ddriver_pwrite(fd, vbuffer, 512, size - 512) != 512) {          // 不越界的仍然成功
+        printf("device end check mismatch\n");
+        return -1;
+    }
     ddriver_close(fd);
 
     printf("Test Pass :)\n");